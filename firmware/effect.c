@@ -0,0 +1,168 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "effect.h"
+
+
+/* Procedural effects, computed on the device every millisecond.
+ *
+ * Effects are periodic. The position within the period is a 32 bit
+ * fixed point phase (2^32 = one period), so no division is needed per
+ * tick. It follows the time since the start, not the number of ticks,
+ * so that devices whose clocks are synchronized (see timer_sync) stay in
+ * step, even if one misses a tick. Usually that's one step per tick (an
+ * addition); after a missed tick or a clock step, the phase is computed
+ * from the time (a 32x32 bit multiplication, which costs more).
+ */
+
+
+static struct {
+  uint8_t type;
+  uint8_t duty;  // strobe/alternate: on-time in 1/256 of the period
+  unsigned long start;  // time of phase 0
+  uint32_t step;  // phase per ms
+  unsigned long time;  // time of phase
+  uint32_t phase;
+  uint16_t primary[3], secondary[3];
+} effect;
+
+
+/* Start an effect with a period of <period> ms (must not be 0), at the
+ * time <start> (see timer.h).
+ *
+ * Duty is the part of the period that strobe flashes or alternate shows
+ * the primary color, in 1/256 (0 for the default: 1/16 and 1/2).
+ */
+void effect_start(uint8_t type, uint8_t duty, uint16_t period,
+  const uint16_t primary[3], const uint16_t secondary[3], unsigned long start)
+{
+  if (period == 0 || type > EFFECT_ALTERNATE) {
+    effect_stop();
+    return;
+  }
+
+  if (duty == 0) {
+    duty = type == EFFECT_STROBE ? 16 : 128;
+  }
+
+  effect.type = type;
+  effect.duty = duty;
+  effect.start = start;
+  effect.step = 0xffffffffUL / period;
+  effect.time = start;
+  effect.phase = 0;
+  for (uint8_t i = 0; i < 3; i++) {
+    effect.primary[i] = primary[i];
+    effect.secondary[i] = secondary[i];
+  }
+}
+
+void effect_stop()
+{
+  effect.type = EFFECT_NONE;
+}
+
+bool effect_running()
+{
+  return effect.type != EFFECT_NONE;
+}
+
+// scale returns value * fraction / 2^16.
+static uint16_t scale(uint16_t value, uint16_t fraction)
+{
+  return ((uint32_t)value * fraction) >> 16;
+}
+
+// mix returns a + (b - a) * fraction / 2^16.
+static uint16_t mix(uint16_t a, uint16_t b, uint16_t fraction)
+{
+  if (b >= a) {
+    return a + scale(b - a, fraction);
+  } else {
+    return a - scale(a - b, fraction);
+  }
+}
+
+// hue_to_rgb converts a hue (2^16 = full circle) to a fully saturated
+// color of the given brightness.
+static void hue_to_rgb(uint16_t hue, uint16_t value, uint16_t rgb[3])
+{
+  // 6 sectors of 2^16 / 6
+  uint32_t h6 = (uint32_t)hue * 6;
+  uint8_t sector = h6 >> 16;
+  uint16_t rising = scale(value, h6 & 0xffff);
+  uint16_t falling = value - rising;
+
+  switch (sector) {
+    case 0:  rgb[0] = value;   rgb[1] = rising;  rgb[2] = 0;       break;
+    case 1:  rgb[0] = falling; rgb[1] = value;   rgb[2] = 0;       break;
+    case 2:  rgb[0] = 0;       rgb[1] = value;   rgb[2] = rising;  break;
+    case 3:  rgb[0] = 0;       rgb[1] = falling; rgb[2] = value;   break;
+    case 4:  rgb[0] = rising;  rgb[1] = 0;       rgb[2] = value;   break;
+    default: rgb[0] = value;   rgb[1] = 0;       rgb[2] = falling; break;
+  }
+}
+
+/* Compute the effect's color at the time <now>.
+ *
+ * Returns true if rgb was changed, false otherwise (also if no effect
+ * is running).
+ */
+bool effect_tick(unsigned long now, uint16_t rgb[3])
+{
+  if (effect.type == EFFECT_NONE) {
+    return false;
+  }
+
+  unsigned long elapsed = now - effect.time;
+  if (elapsed == 1) {
+    effect.phase += effect.step;
+  } else if (elapsed != 0) {
+    effect.phase = (uint32_t)(now - effect.start) * effect.step;
+  }
+  effect.time = now;
+  uint16_t t = effect.phase >> 16;
+  uint16_t out[3];
+
+  switch (effect.type) {
+
+    // Triangle wave: secondary -> primary -> secondary
+    case EFFECT_BREATHE: {
+      uint16_t fraction = t < 0x8000 ? t << 1 : (0xffff - t) << 1;
+      for (uint8_t i = 0; i < 3; i++) {
+        out[i] = mix(effect.secondary[i], effect.primary[i], fraction);
+      }
+      break;
+    }
+
+    case EFFECT_RAINBOW: {
+      uint16_t value = effect.primary[0];
+      if (effect.primary[1] > value) value = effect.primary[1];
+      if (effect.primary[2] > value) value = effect.primary[2];
+      hue_to_rgb(t, value, out);
+      break;
+    }
+
+    case EFFECT_STROBE:
+    case EFFECT_ALTERNATE: {
+      bool on = (t >> 8) < effect.duty;
+      const uint16_t *off = effect.type == EFFECT_ALTERNATE ? effect.secondary : 0;
+      for (uint8_t i = 0; i < 3; i++) {
+        out[i] = on ? effect.primary[i] : (off ? off[i] : 0);
+      }
+      break;
+    }
+
+    default:
+      return false;
+  }
+
+  bool changed = false;
+  for (uint8_t i = 0; i < 3; i++) {
+    if (rgb[i] != out[i]) {
+      rgb[i] = out[i];
+      changed = true;
+    }
+  }
+  return changed;
+}
@@ -0,0 +1,19 @@
+#ifndef _EFFECT_H
+#define _EFFECT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EFFECT_NONE       0
+#define EFFECT_BREATHE    1  // fade between primary and secondary color
+#define EFFECT_RAINBOW    2  // hue wheel at the primary color's brightness
+#define EFFECT_STROBE     3  // short flashes of the primary color
+#define EFFECT_ALTERNATE  4  // switch between primary and secondary color
+
+void effect_start(uint8_t type, uint8_t duty, uint16_t period,
+  const uint16_t primary[3], const uint16_t secondary[3], unsigned long start);
+void effect_stop();
+bool effect_running();
+bool effect_tick(unsigned long now, uint16_t rgb[3]);
+
+#endif
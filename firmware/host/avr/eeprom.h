@@ -0,0 +1,16 @@
+#ifndef _HOST_AVR_EEPROM_H
+#define _HOST_AVR_EEPROM_H
+
+/* Host build shim: EEPROM is an array in shim.c (erased: 0xff). */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define E2END 511
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+void eeprom_write_byte(uint8_t *addr, uint8_t value);
+void eeprom_update_byte(uint8_t *addr, uint8_t value);
+#define eeprom_is_ready() true
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _HOST_AVR_INTERRUPT_H
+#define _HOST_AVR_INTERRUPT_H
+
+/* Host build shim: there are no interrupts. */
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+#define cli()
+#define sei()
+
+#endif
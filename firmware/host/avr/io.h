@@ -0,0 +1,23 @@
+#ifndef _HOST_AVR_IO_H
+#define _HOST_AVR_IO_H
+
+/* Host build shim: I/O registers are plain variables (see shim.c). */
+
+#include <stdint.h>
+
+extern volatile uint8_t PORTB, DDRB, PINB, SREG, CLKPR, OSCCAL, MCUSR;
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+
+#define CLKPCE 7
+#define PORF 0
+
+#define _SFR_IO_ADDR(reg) 0
+#define _BV(bit) (1 << (bit))
+
+#endif
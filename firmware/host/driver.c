@@ -0,0 +1,228 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+
+#include "usbconfig.h"
+#include "usbdrv.h"
+
+#include "shim.h"
+#include "timer.h"
+
+
+/* Host build driver for the firmware.
+ *
+ * Runs the firmware's request handling and main loop tick on the host.
+ * Reads commands from stdin, one per line:
+ *
+ *   setup <request> [<value> [<index>]]     control transfer without data
+ *   write <request> <value> <index> <byte>...
+ *                                           control-out transfer with data
+ *   in <request> [<value> [<index>]]        control-in transfer; prints the reply
+ *   out <byte>...                           interrupt-out packet (streaming)
+ *   tick [<n>]                              advance time by n (1) ms
+ *   skip [<n>]                              advance time by n (1) ms without
+ *                                           ticks, as if the main loop was busy
+ *   show                                    print LED and status LED output
+ *   restore                                 restore the saved settings, as at
+ *                                           power-on (once, before they're saved)
+ *   reset                                   USB reset; prints the calibrated OSCCAL
+ *   clock <osccal>                          OSCCAL value the oscillator is exact at
+ *   eeprom <addr> [<n>]                     print n (1) bytes of EEPROM
+ *   fail [<n>]                              report the next n (1) LED writes
+ *                                           as interrupted
+ *
+ * Everything after a '#' is ignored.
+ *
+ * This checks behavior only. For timing, host run times say little about
+ * the AVR: "make profile" counts the cycles under simavr (sim/profile.c).
+ */
+
+
+#define MAX_BYTES 256
+
+extern usbMsgLen_t usbFunctionSetup(uchar setupData[8]);
+extern uchar usbFunctionWrite(uchar *data, uchar len);
+extern void usbFunctionWriteOut(uchar *data, uchar len);
+extern void tick(unsigned long now);
+extern bool restore_state();
+extern void hadUsbReset();
+
+
+// Advances real time by one millisecond, and runs the firmware's tick
+// if its clock advanced (as the main loop does).
+static void run_tick()
+{
+  shim_advance(1);
+  time_val_t now = timer_get();
+  if (now.updated) {
+    tick(now.time);
+  }
+}
+
+// Sends a vendor control-out transfer. Returns false if it was stalled.
+static bool control_transfer(uint8_t request, uint16_t value, uint16_t index,
+  uint8_t *data, uint16_t length)
+{
+  // Setup packet plus CRC, as V-USB passes it to usbFunctionSetup
+  uchar setup[8 + 2] = {
+    0x40, request,
+    value & 0xff, value >> 8,
+    index & 0xff, index >> 8,
+    length & 0xff, length >> 8,
+  };
+  unsigned crc = usbCrc16(setup, 8);
+  setup[8] = crc & 0xff;
+  setup[9] = crc >> 8;
+
+  usbMsgLen_t ret = usbFunctionSetup(setup);
+  if (ret != USB_NO_MSG || length == 0) {
+    return true;
+  }
+
+  // Data stage in packets of up to 8 bytes
+  for (uint16_t pos = 0; pos < length; pos += 8) {
+    uchar len = length - pos < 8 ? length - pos : 8;
+    uchar result = usbFunctionWrite(data + pos, len);
+    if (result == 0xff) {
+      return false;
+    } else if (result == 1) {
+      break;
+    }
+  }
+  return true;
+}
+
+// Sends a vendor control-in transfer and prints the reply bytes.
+static void control_in_transfer(uint8_t request, uint16_t value, uint16_t index)
+{
+  uint16_t length = 64;
+  uchar setup[8 + 2] = {
+    0xc0, request,
+    value & 0xff, value >> 8,
+    index & 0xff, index >> 8,
+    length & 0xff, length >> 8,
+  };
+  unsigned crc = usbCrc16(setup, 8);
+  setup[8] = crc & 0xff;
+  setup[9] = crc >> 8;
+
+  usbMsgLen_t ret = usbFunctionSetup(setup);
+  const uint8_t *reply = (const uint8_t *)usbMsgPtr;
+  printf("in:");
+  for (usbMsgLen_t i = 0; i < ret && i < length; i++) {
+    printf(" %02x", reply[i]);
+  }
+  printf("\n");
+}
+
+static void show()
+{
+  printf("%lu ms:", timer_now());
+  for (int i = 0; i < 3 * WS2812B_NUM_PIXELS; i += 3) {
+    // GRB -> RGB
+    printf(" %02x%02x%02x", shim_leds.grb[i + 1], shim_leds.grb[i], shim_leds.grb[i + 2]);
+  }
+  printf(" status=%s writes=%lu\n",
+      (PORTB & (1 << PB4)) ? "off" : "on", shim_leds.writes);
+}
+
+// parse_numbers parses all remaining words of the line.
+static int parse_numbers(unsigned long *numbers, int max)
+{
+  int n = 0;
+  for (char *tok = strtok(NULL, " \t\r\n"); tok != NULL; tok = strtok(NULL, " \t\r\n")) {
+    if (n == max) return -1;
+    char *end;
+    numbers[n++] = strtoul(tok, &end, 0);
+    if (*end != '\0') return -1;
+  }
+  return n;
+}
+
+int main(int argc, char **argv)
+{
+  char line[1024];
+  unsigned long lineno = 0;
+
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    lineno++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL) *comment = '\0';
+
+    char *cmd = strtok(line, " \t\r\n");
+    if (cmd == NULL) continue;
+
+    unsigned long numbers[3 + MAX_BYTES];
+    int n = parse_numbers(numbers, 3 + MAX_BYTES);
+    if (n < 0) {
+      fprintf(stderr, "line %lu: bad arguments\n", lineno);
+      return 1;
+    }
+
+    uint8_t data[MAX_BYTES];
+    if (0 == strcmp("setup", cmd) && n >= 1 && n <= 3) {
+      control_transfer(numbers[0], n > 1 ? numbers[1] : 0, n > 2 ? numbers[2] : 0, NULL, 0);
+
+    } else if (0 == strcmp("write", cmd) && n >= 4) {
+      for (int i = 3; i < n; i++) data[i - 3] = numbers[i];
+      if (!control_transfer(numbers[0], numbers[1], numbers[2], data, n - 3)) {
+        printf("stall\n");
+      }
+
+    } else if (0 == strcmp("in", cmd) && n >= 1 && n <= 3) {
+      control_in_transfer(numbers[0], n > 1 ? numbers[1] : 0, n > 2 ? numbers[2] : 0);
+
+    } else if (0 == strcmp("out", cmd) && n >= 1 && n <= 8) {
+      for (int i = 0; i < n; i++) data[i] = numbers[i];
+      usbFunctionWriteOut(data, n);
+
+    } else if (0 == strcmp("tick", cmd) && n <= 1) {
+      unsigned long ticks = n > 0 ? numbers[0] : 1;
+      for (unsigned long i = 0; i < ticks; i++) {
+        run_tick();
+      }
+
+    } else if (0 == strcmp("skip", cmd) && n <= 1) {
+      shim_advance(n > 0 ? numbers[0] : 1);
+
+    } else if (0 == strcmp("show", cmd) && n == 0) {
+      show();
+
+    } else if (0 == strcmp("reset", cmd) && n == 0) {
+      unsigned calibrations = shim_calibrations;
+      hadUsbReset();
+      printf("osccal %#x%s\n", OSCCAL,
+          shim_calibrations != calibrations ? " (full search)" : "");
+
+    } else if (0 == strcmp("clock", cmd) && n == 1) {
+      shim_osccal_target = numbers[0];
+
+    } else if (0 == strcmp("eeprom", cmd) && n >= 1 && n <= 2) {
+      unsigned long count = n > 1 ? numbers[1] : 1;
+      printf("eeprom %#lx:", numbers[0]);
+      for (unsigned long i = numbers[0]; i < numbers[0] + count && i <= E2END; i++) {
+        printf(" %02x", shim_eeprom[i]);
+      }
+      printf("\n");
+
+    } else if (0 == strcmp("fail", cmd) && n <= 1) {
+      shim_leds.fail = n > 0 ? numbers[0] : 1;
+
+    } else if (0 == strcmp("restore", cmd) && n == 0) {
+      if (!restore_state()) {
+        printf("nothing to restore\n");
+      }
+
+    } else {
+      fprintf(stderr, "line %lu: unknown command\n", lineno);
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,203 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+
+#include "usbconfig.h"
+#include "usbdrv.h"
+
+#include "osccal.h"
+#include "timer.h"
+#include "ws2812b.h"
+#include "shim.h"
+
+
+/* Host build shims for the hardware and V-USB.
+ *
+ * Registers are plain variables, the timer is advanced by the driver,
+ * and LED output is recorded instead of bit-banged.
+ */
+
+
+volatile uint8_t PORTB, DDRB, PINB, SREG, CLKPR, OSCCAL, MCUSR;
+
+usbMsgPtr_t usbMsgPtr;
+
+shim_leds_t shim_leds;
+
+uint16_t ws2812b_sent, ws2812b_interrupted;
+
+static unsigned long shim_time;
+static bool shim_updated;
+
+// Timer counts: 129 per millisecond, like timer.c's every other one. Slew
+// (see timer_sync) makes a millisecond one count shorter or longer.
+#define SHIM_COUNTS 129
+static unsigned shim_count;  // counts into the current millisecond
+static long shim_slew;
+
+
+void usbInit(void)
+{
+}
+
+void usbPoll(void)
+{
+}
+
+// Same algorithm as V-USB's (CRC-16/USB, not yet inverted for sending).
+unsigned usbCrc16(const void *data, uchar len)
+{
+  const uint8_t *p = data;
+  unsigned crc = 0xffff;
+  while (len--) {
+    crc ^= *p++;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+  }
+  return crc ^ 0xffff;
+}
+
+uint8_t shim_osccal_target = 0xa0;
+unsigned shim_calibrations;
+
+// The full search always finds the target.
+void calibrateOscillatorASM(void)
+{
+  OSCCAL = shim_osccal_target;
+  shim_calibrations++;
+}
+
+// 16 loops per OSCCAL step. (On the chip, the two ranges overlap, so a
+// step across them is far larger; refine_osccal doesn't take it.)
+int16_t osccalFrameDeviation(void)
+{
+  return ((int16_t)shim_osccal_target - OSCCAL) * 16;
+}
+
+uint8_t shim_eeprom[E2END + 1] = { [0 ... E2END] = 0xff };
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+  return shim_eeprom[(uintptr_t)addr];
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value)
+{
+  shim_eeprom[(uintptr_t)addr] = value;
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+  eeprom_write_byte(addr, value);
+}
+
+void timer_init()
+{
+}
+
+time_val_t timer_get()
+{
+  time_val_t result = { .time = shim_time, .updated = shim_updated };
+  shim_updated = false;
+  return result;
+}
+
+unsigned long timer_now()
+{
+  return shim_time;
+}
+
+// Steps or slews like timer.c.
+long timer_sync(unsigned long time)
+{
+  long offset = time - shim_time;
+  if (offset > 250 || offset < -250) {
+    shim_time = time;
+    shim_slew = 0;
+    return offset;
+  }
+  shim_slew = offset * SHIM_COUNTS;
+  return 0;
+}
+
+uint16_t timer_counts()
+{
+  return shim_time * SHIM_COUNTS + shim_count;
+}
+
+// Advances real time by ms milliseconds. The clock advances as much,
+// give or take a slew.
+void shim_advance(unsigned long ms)
+{
+  for (unsigned long i = 0; i < ms; i++) {
+    shim_count += SHIM_COUNTS;
+    while (1) {
+      unsigned length = SHIM_COUNTS - (shim_slew > 0) + (shim_slew < 0);
+      if (shim_count < length) {
+        break;
+      }
+      shim_count -= length;
+      shim_time++;
+      shim_updated = true;
+      if (shim_slew > 0) {
+        shim_slew--;
+      } else if (shim_slew < 0) {
+        shim_slew++;
+      }
+    }
+  }
+}
+
+// No gamma table on the host: plain resolution reduction (16 -> 8 bit).
+uint8_t ws2812b_gamma(uint16_t value)
+{
+  return value >> 8;
+}
+
+// Same for the 8.8 bit version.
+uint16_t ws2812b_gamma16(uint16_t value)
+{
+  return value;
+}
+
+// Counts a transmission. Returns false if it is to be reported as
+// interrupted (see shim_leds.fail).
+static bool shim_sent()
+{
+  shim_leds.writes++;
+  ws2812b_sent++;
+  if (shim_leds.fail > 0) {
+    shim_leds.fail--;
+    ws2812b_interrupted++;
+    return false;
+  }
+  return true;
+}
+
+bool ws2812b_set_rgb(uint16_t r, uint16_t g, uint16_t b)
+{
+  uint8_t grb[3] = { ws2812b_gamma(g), ws2812b_gamma(r), ws2812b_gamma(b) };
+  return ws2812b_set_grb(grb);
+}
+
+bool ws2812b_set_grb(const uint8_t grb[3])
+{
+  for (int i = 0; i < WS2812B_NUM_PIXELS; i++) {
+    shim_leds.grb[3*i] = grb[0];
+    shim_leds.grb[3*i + 1] = grb[1];
+    shim_leds.grb[3*i + 2] = grb[2];
+  }
+  return shim_sent();
+}
+
+bool ws2812b_write(const uint8_t *grb, uint16_t length)
+{
+  for (int i = 0; i < length && i < 3 * WS2812B_NUM_PIXELS; i++) {
+    shim_leds.grb[i] = grb[i];
+  }
+  return shim_sent();
+}
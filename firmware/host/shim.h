@@ -0,0 +1,27 @@
+#ifndef _HOST_SHIM_H
+#define _HOST_SHIM_H
+
+#include <stdint.h>
+
+#include "ws2812b.h"
+
+// What the firmware last sent to the LEDs
+typedef struct {
+  uint8_t grb[3 * WS2812B_NUM_PIXELS];
+  unsigned long writes;
+  unsigned fail;  // number of following writes to report as interrupted
+} shim_leds_t;
+
+extern shim_leds_t shim_leds;
+
+// RC oscillator: the OSCCAL value at which it runs at 16.5 MHz, and the
+// number of full calibration searches so far (see osccal.S)
+extern uint8_t shim_osccal_target;
+extern unsigned shim_calibrations;
+
+// EEPROM contents (see avr/eeprom.h)
+extern uint8_t shim_eeprom[];
+
+void shim_advance(unsigned long ms);
+
+#endif
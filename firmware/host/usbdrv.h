@@ -0,0 +1,46 @@
+#ifndef _HOST_USBDRV_H
+#define _HOST_USBDRV_H
+
+/* Host build shim for the parts of V-USB's usbdrv.h the firmware uses. */
+
+#include <stdint.h>
+
+typedef unsigned char uchar;
+typedef uint16_t usbMsgLen_t;
+
+typedef union {
+  uint16_t word;  // 16 bit, like unsigned on the AVR
+  uchar bytes[2];
+} usbWord_t;
+
+typedef struct {
+  uchar bmRequestType;
+  uchar bRequest;
+  usbWord_t wValue;
+  usbWord_t wIndex;
+  usbWord_t wLength;
+} usbRequest_t;
+
+#define USB_NO_MSG ((usbMsgLen_t)-1)
+
+#define USBDESCR_CONFIG     2
+#define USBDESCR_STRING     3
+#define USBDESCR_INTERFACE  4
+#define USBDESCR_ENDPOINT   5
+
+#define USB_PROP_IS_DYNAMIC   (1u << 14)
+#define USB_PROP_IS_RAM       (1u << 15)
+#define USB_PROP_LENGTH(len)  ((len) & 0x3fff)
+
+#define USB_STRING_DESCRIPTOR_HEADER(stringLength) ((2*(stringLength)+2) | (3<<8))
+
+#define usbDeviceConnect()
+#define usbDeviceDisconnect()
+
+extern usbMsgPtr_t usbMsgPtr;
+
+void usbInit(void);
+void usbPoll(void);
+unsigned usbCrc16(const void *data, uchar len);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef _HOST_UTIL_ATOMIC_H
+#define _HOST_UTIL_ATOMIC_H
+
+/* Host build shim: there are no interrupts, so everything is atomic. */
+
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type) for (int _atomic_once = 1; _atomic_once; _atomic_once = 0)
+
+#endif
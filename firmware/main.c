@@ -1,12 +1,18 @@
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <util/delay.h>
 
 #include "usbconfig.h"
-#include "usbdrv/usbdrv.h"
+#include "usbdrv.h"
 
+#include "effect.h"
 #include "osccal.h"
+#include "persist.h"
+#include "queue.h"
+#include "sched.h"
 #include "ws2812b.h"
 #include "timer.h"
 
@@ -16,6 +22,15 @@
 #define STATUS_LED_DDR      DDRB
 #define STATUS_LED_DDR_MASK (1 << STATUS_LED_PIN)
 
+// Countdown timers (see sched.h)
+#define SCHED_BLINK         0  // end of the current blink phase
+#define SCHED_STATUS        1  // end of the current status LED blink phase
+#define SCHED_PERSIST       2  // settings unchanged long enough to save them
+
+// Settings are saved (OPTION_PERSIST) once they have been left alone for
+// this long, so a stream or a running sequence doesn't wear the EEPROM.
+#define PERSIST_DELAY       2000
+
 
 typedef struct {
   // Buffered red/green/blue channel and status led values
@@ -25,16 +40,206 @@ typedef struct {
   // Fading parameters
   uint16_t red_target, green_target, blue_target, fade_rate;
 
+  // Timed fade (request 21): milliseconds left (0 = fading at fade_rate
+  // instead), red/green/blue values and steps per millisecond (16.16 fixed
+  // point).
+  uint32_t fade_left;
+  uint32_t fade_value[3];
+  int32_t fade_step[3];
+
   // Blinking parameters
   uint16_t blink_duty, blink_period;
+  bool blink_dark;  // in the off phase?
+
+  // Show the frame buffer instead of the channel values?
+  bool show_frame;
+
+  // Secondary color for effects
+  uint16_t red2, green2, blue2;
+
+  // Color for filling the frame buffer (request 12)
+  uint16_t fill_red, fill_green, fill_blue;
+
+  // Options (OPTION_* bits, see request 22)
+  uint8_t options;
+
+  // Channel values changed (by 3-5) since they were last shown?
+  bool uncommitted;
+
+  // Last effect started (request 15): its arguments and primary color
+  uint16_t effect_value, effect_index;
+  uint16_t effect_red, effect_green, effect_blue;
 } state_t;
 
+// Temporal dithering of the channel values (see show)
+#define OPTION_DITHER       (1 << 0)
+// Frame uploads are already gamma corrected (see frame_upload_write)
+#define OPTION_PASSTHROUGH  (1 << 1)
+// Save the settings in EEPROM, and restore them at power-on (see save_state)
+#define OPTION_PERSIST      (1 << 2)
+
 
 state_t global_state = {
   .fade_rate = 256,
 };
 
 
+// Batches are buffered completely before any request in them is applied.
+#define BATCH_VERSION     1
+#define BATCH_MAX_LENGTH  32
+
+static struct {
+  uint8_t data[BATCH_MAX_LENGTH];
+  uint8_t length, received;
+} batch;
+
+
+// Counters for diagnostics, read with request 25. All wrap around.
+typedef struct {
+  uint16_t setups;        // control transfers handled
+  uint16_t crc_errors;    // setup packets ignored for a bad CRC
+  uint16_t unknown;       // unknown requests
+  uint16_t rejected;      // batches and frame uploads rejected (stalled)
+  uint16_t missed_ticks;  // milliseconds the main loop didn't get to
+  uint16_t led_sent;      // transmissions to the LED chain
+  uint16_t led_interrupted;  // ... of them interrupted and sent again
+  uint16_t max_loop;      // longest main loop iteration, in 7.76us counts
+} stats_t;
+
+static stats_t stats;
+
+
+// State readback (request 26), for the host to skip requests that would
+// change nothing. Little-endian, no padding.
+typedef struct __attribute__((packed)) {
+  uint32_t fade_left;
+  uint16_t red, green, blue;
+  uint16_t red_target, green_target, blue_target, fade_rate;
+  uint16_t blink_duty, blink_period;
+  uint16_t red2, green2, blue2;
+  uint8_t status, options, flags;  // flags: STATE_* bits
+  uint8_t queued;  // requests in the queue
+} state_reply_t;
+
+#define STATE_SHOW_FRAME    (1 << 0)
+#define STATE_BLINK_DARK    (1 << 1)
+#define STATE_BLINKING      (1 << 2)
+#define STATE_EFFECT        (1 << 3)
+#define STATE_UNCOMMITTED   (1 << 4)
+#define STATE_STATUS_LED    (1 << 5)  // status LED on
+
+// Replies to control-in requests, sent in the data stage
+static union {
+  stats_t stats;
+  state_reply_t state;
+} reply;
+
+
+// The last settings saved (or restored) had OPTION_PERSIST set.
+static bool persisted;
+
+
+// Queued requests' times are relative to this (see requests 19 and 20).
+static unsigned long queue_epoch;
+
+// Time of the last tick (see tick).
+static unsigned long last_tick;
+
+
+// Frame buffer for daisy-chained LEDs: gamma corrected GRB bytes per pixel.
+static uint8_t frame[WS2812B_NUM_PIXELS * 3];
+
+// Frame buffer upload (request 14) in progress.
+static struct {
+  bool active;
+  bool show;  // show frame when complete?
+  uint16_t pos, end;  // byte offsets in frame of current pixel, end of upload
+  uint8_t channel;  // 0 = red, 1 = green, 2 = blue
+} frame_upload;
+
+
+// Last frame received on the streaming endpoint, latched on the next tick.
+static struct {
+  uint16_t red, green, blue;
+  bool pending;
+} stream;
+
+
+// Configuration descriptor. Same as V-USB's default one, plus the
+// interrupt-out endpoint 1 for streaming.
+PROGMEM const char usbDescriptorConfiguration[] = {
+  9,                         // sizeof(usbDescriptorConfiguration): length of descriptor in bytes
+  USBDESCR_CONFIG,           // descriptor type
+  9 + 9 + 7, 0,              // total length of data returned (including inlined descriptors)
+  1,                         // number of interfaces in this configuration
+  1,                         // index of this configuration
+  0,                         // configuration name string index
+  (1 << 7),                  // attributes: bus powered
+  USB_CFG_MAX_BUS_POWER/2,   // max USB current in 2mA units
+
+  9,                         // sizeof(usbDescrInterface): length of descriptor in bytes
+  USBDESCR_INTERFACE,        // descriptor type
+  0,                         // index of this interface
+  0,                         // alternate setting for this interface
+  1,                         // endpoints excl 0: number of endpoint descriptors to follow
+  USB_CFG_INTERFACE_CLASS,
+  USB_CFG_INTERFACE_SUBCLASS,
+  USB_CFG_INTERFACE_PROTOCOL,
+  0,                         // string index for interface
+
+  7,                         // sizeof(usbDescrEndpoint)
+  USBDESCR_ENDPOINT,         // descriptor type = endpoint
+  0x01,                      // OUT endpoint number 1
+  0x03,                      // attrib: interrupt endpoint
+  8, 0,                      // maximum packet size
+  USB_CFG_INTR_POLL_INTERVAL,  // in ms
+};
+
+
+// Serial number string descriptor (see usbconfig.h), so that the tool can
+// tell devices apart. Read from EEPROM by load_serial; written there when
+// flashing (see the Makefile).
+#define EEPROM_SERIAL       ((uint8_t *)0)
+#define SERIAL_LENGTH       8
+
+int usbDescriptorStringSerialNumber[1 + SERIAL_LENGTH] = {
+  USB_STRING_DESCRIPTOR_HEADER(SERIAL_LENGTH),
+};
+
+
+/* Read the serial number from EEPROM. Unprogrammed (0xff) or other
+ * unprintable bytes read as '0', so an unserialized device has serial
+ * "00000000".
+ */
+static void load_serial(void)
+{
+  for (uint8_t i = 0; i < SERIAL_LENGTH; i++) {
+    uint8_t c = eeprom_read_byte(EEPROM_SERIAL + i);
+    usbDescriptorStringSerialNumber[1 + i] = (c > ' ' && c <= '~') ? c : '0';
+  }
+}
+
+
+// Last OSCCAL value found by calibration, and its complement (so an erased
+// EEPROM doesn't look like one), to start from after the next USB reset.
+#define EEPROM_OSCCAL       ((uint8_t *)16)
+
+// A cached OSCCAL value is used as long as a frame measures within this
+// many 5 cycle loops (1%) of 1 ms; otherwise the full search is done.
+#define OSCCAL_TOLERANCE    33
+
+// Neighboring values tried after the cached one, at most
+#define OSCCAL_REFINE_STEPS 3
+
+
+/* Read the cached OSCCAL value. Returns false if there is none. */
+static bool load_osccal(uint8_t *value)
+{
+  *value = eeprom_read_byte(EEPROM_OSCCAL);
+  return *value == (uint8_t)~eeprom_read_byte(EEPROM_OSCCAL + 1);
+}
+
+
 /* Turn the green status LED on/off. */
 void set_status_led(bool on_off)
 {
@@ -45,21 +250,176 @@ void set_status_led(bool on_off)
   }
 }
 
-// usbFunctionSetup handles USB Control Transfers.
-extern usbMsgLen_t usbFunctionSetup(uchar setupData[8])
+// Last show was interrupted by USB traffic; show again on the next tick.
+static bool show_again;
+
+// Dithering error per green/red/blue channel, in 1/16 of an output step.
+static uint8_t dither_error[3];
+
+// dither gamma corrects the channel values to 12 bit (8.4 fixed point)
+// and rounds them to 8 bit, such that the average output over the
+// following ticks matches the 12 bit value. The rounding pattern repeats
+// at least every 16 ticks (62.5 Hz), so it doesn't flicker visibly.
+static void dither(uint8_t grb[3])
 {
-  // Verify checksum. V-USB doesn't do it.
-  // (Yes, this out-of-bounds access is ok.)
-  if (usbCrc16(setupData, 8 + 2) != 0x4FFE) {
-    return 0;  // CRC error; ignore packet
+  uint16_t channel[3] = { global_state.green, global_state.red, global_state.blue };
+  for (uint8_t i = 0; i < 3; i++) {
+    uint16_t level = ws2812b_gamma16(channel[i]);
+    grb[i] = level >> 8;
+    dither_error[i] += (level & 0xff) >> 4;
+    if (dither_error[i] >= 16) {
+      dither_error[i] -= 16;
+      if (grb[i] != 0xff) grb[i]++;
+    }
   }
+}
 
-  usbRequest_t *rq = (void *)setupData;
+// show writes the channel values or frame buffer to the LEDs.
+// If dark is true, all LEDs are turned off instead (blinking).
+static void show(bool dark)
+{
+  bool ok;
+  if (dark) {
+    ok = ws2812b_set_rgb(0, 0, 0);
+  } else if (global_state.show_frame) {
+    ok = ws2812b_write(frame, sizeof(frame));
+  } else if (global_state.options & OPTION_DITHER) {
+    uint8_t grb[3];
+    dither(grb);
+    ok = ws2812b_set_grb(grb);
+  } else {
+    ok = ws2812b_set_rgb(global_state.red, global_state.green, global_state.blue);
+  }
+  show_again = !ok;
+  global_state.uncommitted = false;
+}
 
-  switch(rq->bRequest){
+// fade_start begins a timed fade from the channel values to the fade
+// targets, lasting duration milliseconds (at least 1).
+static void fade_start(uint32_t duration)
+{
+  uint16_t from[3] = { global_state.red, global_state.green, global_state.blue };
+  uint16_t to[3] = { global_state.red_target, global_state.green_target, global_state.blue_target };
+
+  effect_stop();
+  if (duration == 0) {
+    duration = 1;
+  }
+
+  for (uint8_t i = 0; i < 3; i++) {
+    // Start in the middle of the value, so truncating rounds.
+    global_state.fade_value[i] = ((uint32_t)from[i] << 16) | 0x8000;
+
+    // Steps are at most 0xffff0000 / 2; with duration 1, the last (and
+    // only) step goes straight to the target anyway.
+    uint32_t distance = (to[i] > from[i]) ? to[i] - from[i] : from[i] - to[i];
+    int32_t step = duration > 1 ? ((distance << 16) / duration) : 0;
+    global_state.fade_step[i] = (to[i] > from[i]) ? step : -step;
+  }
+
+  global_state.fade_left = duration;
+}
+
+// fade_step advances a timed fade by one millisecond.
+// Returns true if a channel was changed, false otherwise.
+static bool fade_step()
+{
+  uint16_t *channel[3] = { &global_state.red, &global_state.green, &global_state.blue };
+  uint16_t target[3] = { global_state.red_target, global_state.green_target, global_state.blue_target };
+  bool changed = false;
+
+  global_state.fade_left--;
+  for (uint8_t i = 0; i < 3; i++) {
+    uint16_t value = target[i];
+    if (global_state.fade_left != 0) {
+      global_state.fade_value[i] += global_state.fade_step[i];
+      value = global_state.fade_value[i] >> 16;
+    }
+    changed |= *channel[i] != value;
+    *channel[i] = value;
+  }
+  return changed;
+}
+
+// save_later (re)starts the countdown to saving the settings, if they are
+// to be saved (or the last ones saved had OPTION_PERSIST, which may have
+// been cleared since).
+static void save_later()
+{
+  if ((global_state.options & OPTION_PERSIST) || persisted) {
+    sched_start(SCHED_PERSIST, PERSIST_DELAY);
+  }
+}
+
+// changes_settings returns true if a request may change the settings
+// saved by save_state.
+static bool changes_settings(uint8_t request)
+{
+  switch(request){
+    case 0:   // off
+    case 1:   // commit
+    case 2:   // status
+    case 6:   // fade targets
+    case 7:
+    case 8:
+    case 9:   // fade speed (0: stop at the current color)
+    case 10:  // blink
+    case 15:  // effect
+    case 16:  // secondary color
+    case 17:
+    case 18:
+    case 22:  // options
+      return true;
+    default:
+      return false;  // 3-5 are saved with the commit that shows them
+  }
+}
+
+/* Save the settings in EEPROM: the committed colors (the fade targets, or
+ * the effect's), blink, status, effect and options. Not the frame buffer.
+ *
+ * The write goes on in the background (see persist.c).
+ */
+static void save_state()
+{
+  if (global_state.uncommitted) {
+    return;  // not shown yet; the commit starts the countdown again
+  }
+
+  bool effect = effect_running();
+  persist_t record = {
+    .red = effect ? global_state.effect_red : global_state.red_target,
+    .green = effect ? global_state.effect_green : global_state.green_target,
+    .blue = effect ? global_state.effect_blue : global_state.blue_target,
+    .red2 = global_state.red2,
+    .green2 = global_state.green2,
+    .blue2 = global_state.blue2,
+    .blink_duty = global_state.blink_duty,
+    .blink_period = global_state.blink_period,
+    .effect_value = effect ? global_state.effect_value : 0,
+    .effect_index = effect ? global_state.effect_index : 0,
+    .status = global_state.status,
+    .options = global_state.options,
+  };
+  if (!persist_save(&record)) {
+    sched_start(SCHED_PERSIST, 100);  // previous write not done yet
+    return;
+  }
+  persisted = global_state.options & OPTION_PERSIST;
+}
+
+// handle_request applies a single vendor request, at the given time (now,
+// or the time it was queued for). Used both for plain control transfers
+// and for batched requests.
+static void handle_request(uint8_t request, uint16_t value, uint16_t index,
+  unsigned long time)
+{
+  switch(request){
 
     // Turn everything off
     case 0:
+      sched_stop(SCHED_STATUS);
+      global_state.fade_left = 0;
       global_state.red = 0;
       global_state.green = 0;
       global_state.blue = 0;
@@ -69,81 +429,547 @@ extern usbMsgLen_t usbFunctionSetup(uchar setupData[8])
       global_state.status = 0;
       // fall-through
 
-    // Make updates take effect (and stops all fading)
+    // Make updates take effect (and stops all fading and effects)
     case 1:
+      effect_stop();
+      global_state.fade_left = 0;
       set_status_led(global_state.status == 1);
-      ws2812b_set_rgb(global_state.red, global_state.green, global_state.blue);
+      global_state.show_frame = false;
+      show(global_state.blink_dark);
       global_state.red_target = global_state.red;
       global_state.green_target = global_state.green;
       global_state.blue_target = global_state.blue;
-      return 0;
+      break;
 
     // Status LED
     case 2:
-      global_state.status = rq->wValue.word & 0xff;
-      return 0;
+      global_state.status = value & 0xff;
+      if (global_state.status != 2) {
+        sched_stop(SCHED_STATUS);
+      } else if (!sched_running(SCHED_STATUS)) {
+        sched_start(SCHED_STATUS, 1);  // first flash on the next tick
+      }
+      break;
 
     // Set channel values immediately (and stops all fading)
     case 3:
-      global_state.red = rq->wValue.word;
+      global_state.fade_left = 0;
+      global_state.uncommitted |= global_state.red != value;
+      global_state.red = value;
       global_state.red_target = global_state.red;
       global_state.green_target = global_state.green;
       global_state.blue_target = global_state.blue;
-      return 0;
+      break;
     case 4:
-      global_state.green = rq->wValue.word;
+      global_state.fade_left = 0;
+      global_state.uncommitted |= global_state.green != value;
+      global_state.green = value;
       global_state.red_target = global_state.red;
       global_state.green_target = global_state.green;
       global_state.blue_target = global_state.blue;
-      return 0;
+      break;
     case 5:
-      global_state.blue = rq->wValue.word;
+      global_state.fade_left = 0;
+      global_state.uncommitted |= global_state.blue != value;
+      global_state.blue = value;
       global_state.red_target = global_state.red;
       global_state.green_target = global_state.green;
       global_state.blue_target = global_state.blue;
-      return 0;
+      break;
 
-    // Fade channel values
+    // Fade channel values (stops effects and timed fades)
     case 6:
-      global_state.red_target = rq->wValue.word;
-      return 0;
+      effect_stop();
+      global_state.fade_left = 0;
+      global_state.red_target = value;
+      break;
     case 7:
-      global_state.green_target = rq->wValue.word;
-      return 0;
+      effect_stop();
+      global_state.fade_left = 0;
+      global_state.green_target = value;
+      break;
     case 8:
-      global_state.blue_target = rq->wValue.word;
-      return 0;
+      effect_stop();
+      global_state.fade_left = 0;
+      global_state.blue_target = value;
+      break;
 
     // Fade speed (16-bit-value per millisec)
     case 9:
-      if (rq->wValue.word > 0) {
-        global_state.fade_rate = rq->wValue.word;
+      if (value > 0) {
+        global_state.fade_rate = value;
       } else {
+        global_state.fade_left = 0;
         global_state.red_target = global_state.red;
         global_state.green_target = global_state.green;
         global_state.blue_target = global_state.blue;
       }
-      return 0;
+      break;
 
-    // Blink rate speed (16-bit-value per millisec)
+    // Blinking: on for value ms out of every index ms, beginning now.
+    // Stops blinking if value is 0 or not less than index.
     case 10:
-      global_state.blink_duty = rq->wValue.word;
-      global_state.blink_period = rq->wIndex.word;
-      if (global_state.blink_period == 0) {
-        ws2812b_set_rgb(global_state.red, global_state.green, global_state.blue);
+      global_state.blink_duty = value;
+      global_state.blink_period = index;
+      global_state.blink_dark = false;
+      if (value > 0 && value < index) {
+        sched_start(SCHED_BLINK, value);
+      } else {
+        sched_stop(SCHED_BLINK);
       }
-      return 0;
+      show(false);
+      break;
+
+    // Fill a range of pixels (first in value, count in index)
+    // of the frame buffer with the fill color (set by 27-29).
+    case 12:
+      if (value < WS2812B_NUM_PIXELS) {
+        uint8_t g = ws2812b_gamma(global_state.fill_green);
+        uint8_t r = ws2812b_gamma(global_state.fill_red);
+        uint8_t b = ws2812b_gamma(global_state.fill_blue);
+        if (index > WS2812B_NUM_PIXELS - value) index = WS2812B_NUM_PIXELS - value;
+        for (uint8_t *p = frame + value * 3; index > 0; index--) {
+          *p++ = g;
+          *p++ = r;
+          *p++ = b;
+        }
+      }
+      break;
+
+    // Show the frame buffer
+    case 13:
+      global_state.show_frame = true;
+      show(global_state.blink_dark);
+      break;
+
+    // Start an effect (see effect.h) with the channel values as primary
+    // color. Type in the low byte of value, duty in the high byte,
+    // period (ms) in index. Type 0 stops the effect.
+    case 15: {
+      global_state.fade_left = 0;
+      uint16_t primary[3] = { global_state.red, global_state.green, global_state.blue };
+      uint16_t secondary[3] = { global_state.red2, global_state.green2, global_state.blue2 };
+      effect_start(value & 0xff, value >> 8, index, primary, secondary, time);
+      global_state.show_frame = false;
+      global_state.effect_value = value;
+      global_state.effect_index = index;
+      global_state.effect_red = global_state.red;
+      global_state.effect_green = global_state.green;
+      global_state.effect_blue = global_state.blue;
+      break;
+    }
+
+    // Secondary color for effects
+    case 16:
+      global_state.red2 = value;
+      break;
+    case 17:
+      global_state.green2 = value;
+      break;
+    case 18:
+      global_state.blue2 = value;
+      break;
+
+    // Start a new sequence of queued requests: clears the queue and sets
+    // the epoch to value milliseconds from now.
+    case 19:
+      queue_clear();
+      queue_epoch = timer_now() + value;
+      break;
+
+    // (20 only has a meaning in batches, see run_batch.)
+
+    // Fade to the fade targets (set by 6-8) in value | index << 16 ms,
+    // with all channels arriving together.
+    case 21:
+      fade_start(value | ((uint32_t)index << 16));
+      break;
+
+    // Options: sets the OPTION_* bits given in index to those in value.
+    case 22:
+      global_state.options = (global_state.options & ~index) | (value & index);
+      break;
+
+    // Synchronize the clock to value | index << 16 ms (see timer_sync).
+    // If it steps, the running sequence moves along, so that its queued
+    // requests still come due when they would have.
+    case 23: {
+      long step = timer_sync(value | ((unsigned long)index << 16));
+      queue_epoch += step;
+      queue_shift(step);
+      last_tick += step;  // a step isn't time that passed
+      break;
+    }
+
+    // (24 only has a meaning in batches, see run_batch.)
+
+    // Fill color for the frame buffer (see 12). Separate from the
+    // channel values, so filling pixels doesn't change those.
+    case 27:
+      global_state.fill_red = value;
+      break;
+    case 28:
+      global_state.fill_green = value;
+      break;
+    case 29:
+      global_state.fill_blue = value;
+      break;
 
     // Ignore unknown requests
     default:
+      stats.unknown++;
+      break;
+  }
+
+  if (changes_settings(request)) {
+    save_later();
+  }
+}
+
+// batch_arg_length returns the number of argument bytes that follow a
+// request in a batch, or -1 if the request may not be batched.
+static int8_t batch_arg_length(uint8_t request)
+{
+  switch(request){
+    case 0:
+    case 1:
+    case 13:
       return 0;
+    case 2:
+    case 3:
+    case 4:
+    case 5:
+    case 6:
+    case 7:
+    case 8:
+    case 9:
+    case 16:
+    case 17:
+    case 18:
+    case 19:
+    case 27:
+    case 28:
+    case 29:
+      return 2;  // value
+    case 10:
+    case 12:
+    case 15:
+    case 20:
+    case 21:
+    case 22:
+    case 23:
+    case 24:
+      return 4;  // value, index
+    default:
+      return -1;
+  }
+}
+
+// run_batch validates and then applies a batch of requests.
+//
+// Format: one version byte (BATCH_VERSION), followed by records of one
+// request byte and its little-endian arguments (see batch_arg_length).
+// Nothing is applied unless the whole batch is well-formed (and all
+// requests to be queued fit into the queue).
+//
+// Request 20 ("at") makes all following requests in the batch (except 19)
+// be queued instead of applied: for the time epoch + value + index * 2^16.
+// Request 24 ("at time") does the same for the time value + index * 2^16,
+// for devices whose clocks were synchronized (see request 23).
+static bool run_batch(const uint8_t *data, uint8_t length)
+{
+  if (length < 1 || data[0] != BATCH_VERSION) {
+    return false;
+  }
+
+  // Validate
+  bool deferred = false;
+  uint8_t queued = 0;
+  for (uint8_t pos = 1; pos < length; ) {
+    uint8_t request = data[pos];
+    int8_t arg_length = batch_arg_length(request);
+    if (arg_length < 0 || length - pos - 1 < arg_length) {
+      return false;
+    }
+    if (request == 20 || request == 24) {
+      deferred = true;
+    } else if (deferred && request != 19) {
+      queued++;
+    }
+    pos += 1 + arg_length;
+  }
+  if (queued > queue_free()) {
+    return false;
+  }
+
+  // Apply
+  deferred = false;
+  bool relative = false;
+  unsigned long time = 0;
+  for (uint8_t pos = 1; pos < length; ) {
+    uint8_t request = data[pos];
+    int8_t arg_length = batch_arg_length(request);
+    uint16_t value = 0, index = 0;
+    if (arg_length >= 2) value = data[pos+1] | (data[pos+2] << 8);
+    if (arg_length >= 4) index = data[pos+3] | (data[pos+4] << 8);
+    if (request == 20 || request == 24) {
+      deferred = true;
+      relative = request == 20;
+      time = (relative ? queue_epoch : 0) + (value | ((unsigned long)index << 16));
+    } else if (deferred && request != 19) {
+      queue_push(time, relative, request, value, index);
+    } else {
+      handle_request(request, value, index, timer_now());
+    }
+    pos += 1 + arg_length;
+  }
+
+  return true;
+}
+
+// read_state fills in a state readback reply (see request 26).
+static void read_state(state_reply_t *state)
+{
+  state->fade_left = global_state.fade_left;
+  state->red = global_state.red;
+  state->green = global_state.green;
+  state->blue = global_state.blue;
+  state->red_target = global_state.red_target;
+  state->green_target = global_state.green_target;
+  state->blue_target = global_state.blue_target;
+  state->fade_rate = global_state.fade_rate;
+  state->blink_duty = global_state.blink_duty;
+  state->blink_period = global_state.blink_period;
+  state->red2 = global_state.red2;
+  state->green2 = global_state.green2;
+  state->blue2 = global_state.blue2;
+  state->status = global_state.status;
+  state->options = global_state.options;
+  state->flags = (global_state.show_frame ? STATE_SHOW_FRAME : 0)
+    | (global_state.blink_dark ? STATE_BLINK_DARK : 0)
+    | (sched_running(SCHED_BLINK) ? STATE_BLINKING : 0)
+    | (effect_running() ? STATE_EFFECT : 0)
+    | (global_state.uncommitted ? STATE_UNCOMMITTED : 0)
+    | (STATUS_LED_PORT & (1 << STATUS_LED_PIN) ? 0 : STATE_STATUS_LED);  // active low
+  state->queued = QUEUE_LENGTH - queue_free();
+}
+
+// usbFunctionSetup handles USB Control Transfers.
+extern usbMsgLen_t usbFunctionSetup(uchar setupData[8])
+{
+  // Verify checksum. V-USB doesn't do it.
+  // (Yes, this out-of-bounds access is ok.)
+  if (usbCrc16(setupData, 8 + 2) != 0x4FFE) {
+    stats.crc_errors++;
+    return 0;  // CRC error; ignore packet
+  }
+
+  usbRequest_t *rq = (void *)setupData;
+  stats.setups++;
+
+  // Statistics (control-in): the stats_t counters. Resets max_loop if
+  // bit 0 of value is set, so that polling gets the worst case per poll.
+  if (rq->bRequest == 25) {
+    stats.led_sent = ws2812b_sent;
+    stats.led_interrupted = ws2812b_interrupted;
+    reply.stats = stats;
+    if (rq->wValue.word & 1) {
+      stats.max_loop = 0;
+    }
+    usbMsgPtr = (usbMsgPtr_t)&reply.stats;
+    return sizeof(reply.stats);
+  }
+
+  // State readback (control-in): a state_reply_t.
+  if (rq->bRequest == 26) {
+    read_state(&reply.state);
+    usbMsgPtr = (usbMsgPtr_t)&reply.state;
+    return sizeof(reply.state);
+  }
+
+  // Batch of requests (sent in the data stage, see usbFunctionWrite)
+  if (rq->bRequest == 11) {
+    frame_upload.active = false;
+    batch.received = 0;
+    if (rq->wLength.word > sizeof(batch.data)) {
+      batch.length = 0;  // too long; usbFunctionWrite will reject it
+    } else {
+      batch.length = rq->wLength.word;
+    }
+    return USB_NO_MSG;
+  }
+
+  // Frame buffer upload: 8 bit red/green/blue bytes per pixel, beginning
+  // at the pixel given in index (sent in the data stage, see usbFunctionWrite).
+  // Shows the frame when complete if bit 0 of value is set. Gamma corrected
+  // here unless OPTION_PASSTHROUGH is set.
+  if (rq->bRequest == 14 && rq->wLength.word == 0) {
+    // Nothing to upload, and no data stage to finish it in: done already
+    frame_upload.active = false;
+    if (rq->wValue.word & 1) {
+      handle_request(13, 0, 0, timer_now());
+    }
+    return 0;
+  }
+  if (rq->bRequest == 14) {
+    uint16_t first = rq->wIndex.word;
+    frame_upload.active = true;
+    frame_upload.show = rq->wValue.word & 1;
+    frame_upload.pos = first * 3;
+    frame_upload.end = frame_upload.pos + rq->wLength.word;
+    frame_upload.channel = 0;
+    if (first >= WS2812B_NUM_PIXELS || rq->wLength.word > sizeof(frame) - frame_upload.pos) {
+      frame_upload.end = 0;  // out of range; usbFunctionWrite will reject it
+    }
+    return USB_NO_MSG;
+  }
+
+  frame_upload.active = false;
+  handle_request(rq->bRequest, rq->wValue.word, rq->wIndex.word, timer_now());
+  return 0;
+}
+
+// frame_upload_write stores uploaded frame data in the frame buffer.
+static uchar frame_upload_write(uchar *data, uchar len)
+{
+  if (frame_upload.end == 0) {
+    stats.rejected++;
+    return 0xff;  // stall
+  }
+
+  // WS2812B uses GRB channel order
+  static const uint8_t offset[3] = { 1, 0, 2 };
+  bool passthrough = global_state.options & OPTION_PASSTHROUGH;
+  for (uint8_t i = 0; i < len; i++) {
+    if (frame_upload.pos + frame_upload.channel >= frame_upload.end) {
+      break;
+    }
+    frame[frame_upload.pos + offset[frame_upload.channel]] =
+      passthrough ? data[i] : ws2812b_gamma((data[i] << 8) | data[i]);
+    if (++frame_upload.channel == 3) {
+      frame_upload.channel = 0;
+      frame_upload.pos += 3;
+    }
+  }
+  if (frame_upload.pos + frame_upload.channel < frame_upload.end) {
+    return 0;  // expect more data
+  }
+
+  if (frame_upload.show) {
+    handle_request(13, 0, 0, timer_now());
   }
+  return 1;
+}
+
+// usbFunctionWrite receives the data stage of control-out transfers
+// in chunks of up to 8 bytes.
+extern uchar usbFunctionWrite(uchar *data, uchar len)
+{
+  if (frame_upload.active) {
+    return frame_upload_write(data, len);
+  }
+
+  if (batch.length == 0) {
+    stats.rejected++;
+    return 0xff;  // stall
+  }
+
+  for (uint8_t i = 0; i < len && batch.received < batch.length; i++) {
+    batch.data[batch.received++] = data[i];
+  }
+  if (batch.received < batch.length) {
+    return 0;  // expect more data
+  }
+
+  if (!run_batch(batch.data, batch.length)) {
+    stats.rejected++;
+    return 0xff;  // stall
+  }
+  return 1;
+}
+
+// usbFunctionWriteOut receives frames sent to the streaming endpoint.
+// A frame is the red, green and blue channel values (16 bit little-endian
+// each); the remaining two bytes of the packet are reserved.
+extern void usbFunctionWriteOut(uchar *data, uchar len)
+{
+  if (len < 6) {
+    return;
+  }
+
+  stream.red = data[0] | (data[1] << 8);
+  stream.green = data[2] | (data[3] << 8);
+  stream.blue = data[4] | (data[5] << 8);
+  stream.pending = true;
+}
+
+// frame_error sets OSCCAL to value and returns how far off the next
+// frame measures (in 5 cycle loops, see osccal.S).
+static uint16_t frame_error(uint8_t value, int16_t *deviation)
+{
+  OSCCAL = value;
+  __asm__ volatile("nop");  // let the oscillator settle
+  *deviation = osccalFrameDeviation();
+  return *deviation < 0 ? -*deviation : *deviation;
+}
+
+/* Refine a cached OSCCAL value: check it against a frame, then step to
+ * its neighbors (in the direction of the error) while they are closer.
+ * That's a few frames, where the full search (calibrateOscillatorASM)
+ * takes ten.
+ *
+ * Returns false if the value is more than OSCCAL_TOLERANCE off (e.g.
+ * after a large change in temperature or supply voltage).
+ */
+static bool refine_osccal(uint8_t value)
+{
+  int16_t deviation;
+
+  cli();
+  uint16_t best = frame_error(value, &deviation);
+  if (best > OSCCAL_TOLERANCE) {
+    sei();
+    return false;
+  }
+
+  int8_t step = deviation > 0 ? 1 : -1;  // too slow: higher is faster
+  for (uint8_t i = 0; i < OSCCAL_REFINE_STEPS && best != 0; i++) {
+    // Stay within the value's range (bit 7 selects one of two
+    // overlapping ones), which also keeps it from wrapping around.
+    if ((uint8_t)(value + step) >> 7 != value >> 7) {
+      break;
+    }
+    uint16_t error = frame_error(value + step, &deviation);
+    if (error >= best) {
+      break;
+    }
+    value += step;
+    best = error;
+  }
+
+  OSCCAL = value;
+  __asm__ volatile("nop");
+  sei();
+  return true;
 }
 
 // hadUsbReset calibrates the internal 16 MHz RC oscillator to run at the
-// 16.5 MHz needed by V-USB after reset.
+// 16.5 MHz needed by V-USB after reset: starting from the last value found
+// (see EEPROM_OSCCAL) if it's still good, with a full search otherwise.
 extern void hadUsbReset() {
-  calibrateOscillatorASM();
+  uint8_t cached;
+  bool valid = load_osccal(&cached);
+  if (!valid || !refine_osccal(cached)) {
+    calibrateOscillatorASM();
+  }
+
+  // Rarely changes, so it hardly ever costs EEPROM writes. Written in
+  // the background, as the EEPROM may still be busy saving the settings.
+  uint8_t value = OSCCAL;
+  if (!valid || value != cached) {
+    persist_set(EEPROM_OSCCAL, value);
+    persist_set(EEPROM_OSCCAL + 1, ~value);
+  }
 }
 
 // fade_to makes channels value closer to target.
@@ -168,6 +994,115 @@ bool fade_to(uint16_t *channel, uint16_t target) {
   return true;
 }
 
+// tick does the once-per-millisecond work of the main loop:
+// queued requests, streaming, fading, effects and blinking.
+void tick(unsigned long now)
+{
+  bool update = false;
+
+  // Usually 1 ms since the last tick; more if the main loop missed some
+  unsigned long elapsed = now - last_tick;
+  last_tick = now;
+  stats.missed_ticks += elapsed - 1;
+  sched_tick(elapsed < 0xffff ? elapsed : 0xffff);
+
+  // Queued requests
+  queue_entry_t entry;
+  while (queue_pop_due(now, &entry)) {
+    handle_request(entry.request, entry.value, entry.index, entry.time);
+  }
+
+  // Streamed frame (stops all fading and effects)
+  if (stream.pending) {
+    stream.pending = false;
+    effect_stop();
+    global_state.fade_left = 0;
+    global_state.red = global_state.red_target = stream.red;
+    global_state.green = global_state.green_target = stream.green;
+    global_state.blue = global_state.blue_target = stream.blue;
+    global_state.show_frame = false;
+    update = true;
+    save_later();
+  }
+
+  // Fading
+  if (global_state.fade_left != 0) {
+    update |= fade_step();
+  } else {
+    update |= fade_to(&global_state.red, global_state.red_target);
+    update |= fade_to(&global_state.green, global_state.green_target);
+    update |= fade_to(&global_state.blue, global_state.blue_target);
+  }
+
+  // Effects
+  uint16_t rgb[3] = { global_state.red, global_state.green, global_state.blue };
+  if (effect_tick(now, rgb)) {
+    global_state.red = global_state.red_target = rgb[0];
+    global_state.green = global_state.green_target = rgb[1];
+    global_state.blue = global_state.blue_target = rgb[2];
+    update = true;
+  }
+
+  // Blinking
+  if (sched_expired(SCHED_BLINK)) {
+    global_state.blink_dark = !global_state.blink_dark;
+    if (global_state.blink_dark) {
+      sched_start(SCHED_BLINK, global_state.blink_period - global_state.blink_duty);
+    } else {
+      sched_start(SCHED_BLINK, global_state.blink_duty);
+    }
+    update = true;
+  }
+
+  // While dithering, the output changes every tick (ws2812b_set_grb
+  // skips it if it doesn't).
+  bool dithering = (global_state.options & OPTION_DITHER) && !global_state.show_frame;
+  if (update || show_again || dithering) {
+    show(global_state.blink_dark);
+  }
+
+  // Status LED: on for 10 ms every second
+  if (sched_expired(SCHED_STATUS)) {
+    bool off = STATUS_LED_PORT & (1 << STATUS_LED_PIN);  // active low
+    set_status_led(off);
+    sched_start(SCHED_STATUS, off ? 10 : 990);
+  }
+
+  // Settings
+  if (sched_expired(SCHED_PERSIST)) {
+    save_state();
+  }
+  persist_poll();
+}
+
+/* Restore the settings saved with OPTION_PERSIST (see save_state), as
+ * the requests that set them would. Returns false if there are none.
+ */
+bool restore_state()
+{
+  persist_t record;
+  if (!persist_load(&record) || !(record.options & OPTION_PERSIST)) {
+    return false;
+  }
+  persisted = true;
+
+  unsigned long now = timer_now();
+  handle_request(3, record.red, 0, now);
+  handle_request(4, record.green, 0, now);
+  handle_request(5, record.blue, 0, now);
+  handle_request(16, record.red2, 0, now);
+  handle_request(17, record.green2, 0, now);
+  handle_request(18, record.blue2, 0, now);
+  handle_request(22, record.options, 0xff, now);
+  handle_request(2, record.status, 0, now);
+  handle_request(1, 0, 0, now);
+  handle_request(10, record.blink_duty, record.blink_period, now);
+  if (record.effect_value & 0xff) {
+    handle_request(15, record.effect_value, record.effect_index, now);
+  }
+  return true;
+}
+
 int main(void) {
 
   // Set clock prescaler to 1 (so we'll run at 16 MHz; we'll switch to 16.5 MHz later).
@@ -175,69 +1110,64 @@ int main(void) {
   CLKPR = 1<<CLKPCE;  // enable change
   CLKPR = 0;  // set factor to 1
 
+  // Run at the last calibrated speed right away, so the LED output is
+  // timed right before USB is up (see hadUsbReset).
+  uint8_t osccal;
+  if (load_osccal(&osccal)) {
+    OSCCAL = osccal;
+  }
+
   // Configure indicator LED pin
   STATUS_LED_DDR |= STATUS_LED_DDR_MASK;
 
   // Make sure the big LED is off
   ws2812b_set_rgb(0,0,0);
 
-  // Blink small led as boot indication
-  set_status_led(true);
-  _delay_ms(33);
-  set_status_led(false);
-  _delay_ms(33);
-  set_status_led(true);
-  _delay_ms(33);
-  set_status_led(false);
-
   timer_init();
+  load_serial();
+
+  // Show the saved settings (OPTION_PERSIST) right away. If there are
+  // any, the boot blink is left out, and so is the reenumeration delay
+  // after a power-on reset: the host can't have seen the device yet.
+  bool restored = restore_state();
+  bool power_on = MCUSR & (1 << PORF);
+  MCUSR = 0;
+
+  // Blink small led as boot indication
+  if (!restored) {
+    set_status_led(true);
+    _delay_ms(33);
+    set_status_led(false);
+    _delay_ms(33);
+    set_status_led(true);
+    _delay_ms(33);
+    set_status_led(false);
+  }
 
   // Initialize USB and reenumerate
   usbInit();
-  usbDeviceDisconnect();
-  _delay_ms(250);
-  usbDeviceConnect();
+  if (!restored || !power_on) {
+    usbDeviceDisconnect();
+    _delay_ms(250);
+    usbDeviceConnect();
+  }
   sei(); // Enable interrupts. By now, all other initialization should be done.
   usbPoll();
 
+  last_tick = timer_now();
   while (1) {
+    uint16_t start = timer_counts();
     usbPoll();
 
     // New millisecond?
     time_val_t now = timer_get();
     if (now.updated) {
-      bool update = false;
-
-      // Fading
-      update |= fade_to(&global_state.red, global_state.red_target);
-      update |= fade_to(&global_state.green, global_state.green_target);
-      update |= fade_to(&global_state.blue, global_state.blue_target);
-
-      // Blinking
-      uint16_t r = global_state.red, g = global_state.green, b = global_state.blue;
-      if (global_state.blink_period != 0) {
-        if (now.time % global_state.blink_period == 0) {
-          update = true;
-        } else if (now.time % global_state.blink_period == global_state.blink_duty) {
-          r = 0;
-          g = 0;
-          b = 0;
-          update = true;
-        }
-      }
-
-      if (update) {
-        ws2812b_set_rgb(r, g, b);
-      }
+      tick(now.time);
+    }
 
-      // Status LED
-      if (global_state.status == 2) {
-        if (now.time % 1000 == 0) {
-          set_status_led(true);
-        } else if (now.time % 1000== 10) {
-          set_status_led(false);
-        }
-      }
+    uint16_t elapsed = timer_counts() - start;
+    if (elapsed > stats.max_loop) {
+      stats.max_loop = elapsed;
     }
   }
 
@@ -1,6 +1,9 @@
 #ifndef _OSCCAL_H
 #define _OSCCAL_H
 
+#include <stdint.h>
+
 void calibrateOscillatorASM(void);
+int16_t osccalFrameDeviation(void);
 
 #endif
@@ -0,0 +1,176 @@
+#include <avr/eeprom.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "persist.h"
+
+
+/* Settings kept in EEPROM across power cycles.
+ *
+ * Records go round a ring of slots, each one to the slot after the last,
+ * so that the writes are spread over the whole area: an EEPROM cell
+ * lasts about 100000 writes, so the ring takes a few million records.
+ * A slot is the record, a sequence number and a checksum, written in
+ * that order. The newest record is the valid one whose successor isn't
+ * valid with the next sequence number. A write cut short by a power
+ * loss (almost certainly) leaves a slot with a bad checksum, and the
+ * previous record stands.
+ *
+ * Writing a byte takes 3.4 ms, during which the CPU keeps running.
+ * persist_save only copies the record; persist_poll (called every tick)
+ * writes the next byte whenever the EEPROM is ready, so the main loop
+ * never waits for it. Other bytes (persist_set) go the same way, ahead
+ * of the record's.
+ */
+
+
+#define SLOT_SIZE   (sizeof(persist_t) + 2)
+#define SLOTS       ((E2END + 1 - PERSIST_START) / SLOT_SIZE)
+
+static struct {
+  uint8_t data[SLOT_SIZE];  // last record saved (or loaded), being written
+  uint8_t pos;  // next byte of data to write; SLOT_SIZE if done
+  uint8_t slot, seq;  // slot and sequence number of data
+} persist = {
+  .pos = SLOT_SIZE,
+  .slot = SLOTS - 1,  // so the first record goes to slot 0
+};
+
+static struct {
+  uint8_t *addr[PERSIST_CELLS];
+  uint8_t value[PERSIST_CELLS];
+  uint8_t pending;  // bit mask of the cells to write
+} cells;
+
+
+static uint8_t *slot_addr(uint8_t slot)
+{
+  return (uint8_t *)(PERSIST_START + slot * SLOT_SIZE);
+}
+
+// checksum of a slot's record and sequence number. Neither an erased slot
+// (all 0xff) nor all zeros pass.
+static uint8_t checksum(const uint8_t *data)
+{
+  uint8_t sum = 0;
+  for (uint8_t i = 0; i < SLOT_SIZE - 1; i++) {
+    sum += data[i];
+  }
+  return ~sum;
+}
+
+// read_slot reads a slot into data. Returns true if it is valid.
+static bool read_slot(uint8_t slot, uint8_t *data)
+{
+  uint8_t *addr = slot_addr(slot);
+  for (uint8_t i = 0; i < SLOT_SIZE; i++) {
+    data[i] = eeprom_read_byte(addr + i);
+  }
+  return data[SLOT_SIZE - 1] == checksum(data);
+}
+
+/* Find the newest record and copy it to record. Returns false if there
+ * is none. Call once, before the first persist_save.
+ */
+bool persist_load(persist_t *record)
+{
+  uint8_t next[SLOT_SIZE];
+  for (uint8_t slot = 0; slot < SLOTS; slot++) {
+    if (!read_slot(slot, persist.data)) {
+      continue;
+    }
+    uint8_t seq = persist.data[SLOT_SIZE - 2];
+    if (read_slot(slot + 1 < SLOTS ? slot + 1 : 0, next)
+        && next[SLOT_SIZE - 2] == (uint8_t)(seq + 1)) {
+      continue;  // not the newest
+    }
+
+    persist.slot = slot;
+    persist.seq = seq;
+    uint8_t *dst = (uint8_t *)record;
+    for (uint8_t i = 0; i < sizeof(persist_t); i++) {
+      dst[i] = persist.data[i];
+    }
+    return true;
+  }
+
+  for (uint8_t i = 0; i < SLOT_SIZE; i++) {
+    persist.data[i] = 0xff;
+  }
+  return false;
+}
+
+/* Start writing record to the next slot. Does nothing if it is the same
+ * as the last one. Returns false if the last one is still being written
+ * (try again later).
+ */
+bool persist_save(const persist_t *record)
+{
+  if (persist.pos < SLOT_SIZE) {
+    return false;
+  }
+
+  const uint8_t *src = (const uint8_t *)record;
+  bool changed = false;
+  for (uint8_t i = 0; i < sizeof(persist_t); i++) {
+    changed |= persist.data[i] != src[i];
+    persist.data[i] = src[i];
+  }
+  if (!changed) {
+    return true;
+  }
+
+  persist.slot = persist.slot + 1 < SLOTS ? persist.slot + 1 : 0;
+  persist.seq++;
+  persist.data[SLOT_SIZE - 2] = persist.seq;
+  persist.data[SLOT_SIZE - 1] = checksum(persist.data);
+  persist.pos = 0;
+  return true;
+}
+
+/* Write a single byte at addr (outside the ring) in the background.
+ * Replaces a value still waiting to be written there. Returns false if
+ * PERSIST_CELLS other bytes are waiting already.
+ */
+bool persist_set(uint8_t *addr, uint8_t value)
+{
+  uint8_t cell = PERSIST_CELLS;
+  for (uint8_t i = 0; i < PERSIST_CELLS; i++) {
+    if ((cells.pending & (1 << i)) && cells.addr[i] == addr) {
+      cell = i;
+      break;
+    } else if (!(cells.pending & (1 << i)) && cell == PERSIST_CELLS) {
+      cell = i;
+    }
+  }
+  if (cell == PERSIST_CELLS) {
+    return false;
+  }
+
+  cells.addr[cell] = addr;
+  cells.value[cell] = value;
+  cells.pending |= 1 << cell;
+  return true;
+}
+
+// persist_poll writes the next byte waiting (see persist_set), or of a
+// record being saved, if the EEPROM is ready for it.
+void persist_poll()
+{
+  if (!eeprom_is_ready()) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < PERSIST_CELLS; i++) {
+    if (cells.pending & (1 << i)) {
+      eeprom_update_byte(cells.addr[i], cells.value[i]);
+      cells.pending &= ~(1 << i);
+      return;
+    }
+  }
+
+  if (persist.pos < SLOT_SIZE) {
+    eeprom_update_byte(slot_addr(persist.slot) + persist.pos, persist.data[persist.pos]);
+    persist.pos++;
+  }
+}
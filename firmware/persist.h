@@ -0,0 +1,33 @@
+#ifndef _PERSIST_H
+#define _PERSIST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// EEPROM area of the record ring (see persist.c). Starts after the serial
+// number and the OSCCAL value (see main.c) and takes the rest of the EEPROM.
+#ifndef PERSIST_START
+#define PERSIST_START 32
+#endif
+
+// Settings restored at power-on (see OPTION_PERSIST in main.c)
+typedef struct {
+  uint16_t red, green, blue;
+  uint16_t red2, green2, blue2;
+  uint16_t blink_duty, blink_period;
+  uint16_t effect_value, effect_index;  // request 15's arguments; 0 = none
+  uint8_t status, options;
+} persist_t;
+
+// Single bytes outside the ring that can wait to be written (see
+// persist_set). Each takes 3 bytes of SRAM.
+#ifndef PERSIST_CELLS
+#define PERSIST_CELLS 2
+#endif
+
+bool persist_load(persist_t *record);
+bool persist_save(const persist_t *record);
+bool persist_set(uint8_t *addr, uint8_t value);
+void persist_poll();
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "queue.h"
+
+
+/* Queue of requests to be applied at a given time (in the timer_get
+ * millisecond base), sorted by time.
+ */
+
+
+static queue_entry_t entries[QUEUE_LENGTH];
+static uint8_t head, count;
+
+
+void queue_clear()
+{
+  head = 0;
+  count = 0;
+}
+
+uint8_t queue_free()
+{
+  return QUEUE_LENGTH - count;
+}
+
+// is_before compares timer values, allowing for overflows.
+static bool is_before(unsigned long a, unsigned long b)
+{
+  return (long)(a - b) < 0;
+}
+
+// insert stores entry at the position pos or before it, moving the
+// entries later than it up (one step of an insertion sort). The entries
+// before pos must be sorted; the one at pos is overwritten.
+static void insert(uint8_t pos, const queue_entry_t *entry)
+{
+  while (pos > 0) {
+    queue_entry_t *prev = &entries[(head + pos - 1) % QUEUE_LENGTH];
+    if (!is_before(entry->time, prev->time)) {
+      break;
+    }
+    entries[(head + pos) % QUEUE_LENGTH] = *prev;
+    pos--;
+  }
+  entries[(head + pos) % QUEUE_LENGTH] = *entry;
+}
+
+/* Queue a request. Requests with the same time are applied in the order
+ * they were queued. Relative is true if the time was given relative to
+ * a sequence's start (request 20), false if as a time of the clock
+ * (request 24).
+ *
+ * Returns false if the queue is full.
+ */
+bool queue_push(unsigned long time, bool relative,
+  uint8_t request, uint16_t value, uint16_t index)
+{
+  if (count == QUEUE_LENGTH) {
+    return false;
+  }
+
+  // Sequences are usually queued in order, so this rarely has to move
+  // anything.
+  queue_entry_t entry = {
+    .time = time,
+    .relative = relative,
+    .request = request,
+    .value = value,
+    .index = index,
+  };
+  insert(count++, &entry);
+  return true;
+}
+
+/* Move the requests queued relative to a sequence's start by <offset>
+ * ms, after the clock was stepped by as much (see timer_sync), so that
+ * they still come due when they would have. Those queued for a time of
+ * the clock stay.
+ */
+void queue_shift(long offset)
+{
+  if (offset == 0) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < count; i++) {
+    queue_entry_t entry = entries[(head + i) % QUEUE_LENGTH];
+    if (entry.relative) {
+      entry.time += offset;
+    }
+    insert(i, &entry);
+  }
+}
+
+/* Take the oldest request out of the queue if its time has come.
+ *
+ * Returns false if there is none.
+ */
+bool queue_pop_due(unsigned long now, queue_entry_t *entry)
+{
+  if (count == 0 || is_before(now, entries[head].time)) {
+    return false;
+  }
+
+  *entry = entries[head];
+  head = (head + 1) % QUEUE_LENGTH;
+  count--;
+  return true;
+}
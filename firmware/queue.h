@@ -0,0 +1,26 @@
+#ifndef _QUEUE_H
+#define _QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of requests that can be queued. Each takes 10 bytes of SRAM.
+#ifndef QUEUE_LENGTH
+#define QUEUE_LENGTH 16
+#endif
+
+typedef struct {
+  unsigned long time;
+  bool relative;  // time relative to a sequence's start (see queue_shift)
+  uint8_t request;
+  uint16_t value, index;
+} queue_entry_t;
+
+void queue_clear();
+uint8_t queue_free();
+bool queue_push(unsigned long time, bool relative,
+  uint8_t request, uint16_t value, uint16_t index);
+void queue_shift(long offset);
+bool queue_pop_due(unsigned long now, queue_entry_t *entry);
+
+#endif
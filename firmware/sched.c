@@ -0,0 +1,65 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sched.h"
+
+
+/* Countdown timers, counted down by the milliseconds between ticks.
+ *
+ * Periodic jobs restart their timer when it expires. That way, a tick
+ * costs one 16 bit subtraction per running timer, instead of a 32 bit
+ * division of the current time per job.
+ */
+
+
+static uint16_t remaining[SCHED_SLOTS];  // 0 = stopped
+static uint8_t expired;  // bit mask, see sched_expired
+
+
+// sched_start (re)starts a timer to expire after ms milliseconds (at
+// least 1). An expiry not yet taken (see sched_expired) is dropped.
+void sched_start(uint8_t slot, uint16_t ms)
+{
+  remaining[slot] = ms ? ms : 1;
+  expired &= ~(1 << slot);
+}
+
+void sched_stop(uint8_t slot)
+{
+  remaining[slot] = 0;
+  expired &= ~(1 << slot);
+}
+
+bool sched_running(uint8_t slot)
+{
+  return remaining[slot] != 0;
+}
+
+/* Count down all running timers by <elapsed> milliseconds (1 per tick,
+ * unless ticks were missed).
+ */
+void sched_tick(uint16_t elapsed)
+{
+  for (uint8_t slot = 0; slot < SCHED_SLOTS; slot++) {
+    if (remaining[slot] == 0) {
+      continue;
+    }
+    if (remaining[slot] <= elapsed) {
+      remaining[slot] = 0;
+      expired |= 1 << slot;
+    } else {
+      remaining[slot] -= elapsed;
+    }
+  }
+}
+
+// sched_expired returns true (once) if the timer expired since it was
+// last started.
+bool sched_expired(uint8_t slot)
+{
+  if (expired & (1 << slot)) {
+    expired &= ~(1 << slot);
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,19 @@
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of countdown timers (see the SCHED_* slots in main.c).
+// At most 8; each takes 2 bytes of SRAM.
+#ifndef SCHED_SLOTS
+#define SCHED_SLOTS 3
+#endif
+
+void sched_start(uint8_t slot, uint16_t ms);
+void sched_stop(uint8_t slot);
+bool sched_running(uint8_t slot);
+void sched_tick(uint16_t elapsed);
+bool sched_expired(uint8_t slot);
+
+#endif
@@ -0,0 +1,94 @@
+"""
+Checks the WS2812B waveform in a VCD trace against the WS2812B timing.
+
+Usage: check_timing.py <trace.vcd> <frame>...
+
+Each frame is the hex string of bytes expected between two latches.
+Exits with status 1 if any bit or latch violates the timing, or the
+decoded frames differ from the expected ones.
+"""
+
+import sys
+
+from vcd import read_changes, intervals
+
+
+# All times in ns. Each bit is 1250 ns, high for 350 ns ("0") or 900 ns ("1").
+TOLERANCE = 150
+T0H, T1H = 350, 900
+T0L, T1L = 900, 350
+# Lows between bytes may be longer (loop overhead), but must stay well
+# below the reset time or the chain latches early.
+MAX_BYTE_GAP = 5000
+LATCH = 50000
+
+
+def within(duration, nominal):
+    return abs(duration - nominal) <= TOLERANCE
+
+
+def main(path, expected):
+    errors = []
+    frames = []
+    bits = []
+
+    def error(time, message):
+        errors.append("%10.0f ns: %s" % (time, message))
+
+    def end_frame():
+        if bits:
+            if len(bits) % 8 != 0:
+                error(time, "frame of %i bits is not a whole number of bytes" % len(bits))
+            data = bytes(int("".join(map(str, bits[i:i+8])), 2) for i in range(0, len(bits) // 8 * 8, 8))
+            frames.append(data.hex())
+            del bits[:]
+
+    worst = {"0 high": 0, "1 high": 0, "0 low": 0, "1 low": 0}
+    spans = intervals(*read_changes(path, "PB3"))
+    for i, (time, duration, value) in enumerate(spans):
+        if value:
+            bit = 1 if duration > (T0H + T1H) / 2 else 0
+            nominal = T1H if bit else T0H
+            worst["%i high" % bit] = max(worst["%i high" % bit], abs(duration - nominal))
+            if not within(duration, nominal):
+                error(time, "%i bit high for %.0f ns (expected %i +-%i)" % (bit, duration, nominal, TOLERANCE))
+            bits.append(bit)
+        elif bits:
+            bit = bits[-1]
+            nominal = T1L if bit else T0L
+            last_of_byte = len(bits) % 8 == 0
+            if duration >= LATCH:
+                end_frame()
+            elif last_of_byte and nominal - TOLERANCE <= duration <= MAX_BYTE_GAP:
+                pass
+            elif duration > MAX_BYTE_GAP:
+                error(time, "low for %.0f ns: neither a bit nor a latch (%i ns)" % (duration, LATCH))
+            else:
+                worst["%i low" % bit] = max(worst["%i low" % bit], abs(duration - nominal))
+                if not within(duration, nominal):
+                    error(time, "%i bit low for %.0f ns (expected %i +-%i)" % (bit, duration, nominal, TOLERANCE))
+
+    # The trace ends when sim/timing.c raises DONE; if the latch after the
+    # last frame isn't in the trace, the firmware stopped too early.
+    if bits:
+        last_time = spans[-1][0] + spans[-1][1] if spans else 0
+        error(last_time, "no latch after last frame")
+        time = last_time
+        end_frame()
+
+    if frames != expected:
+        errors.append("frames %s, expected %s" % (" ".join(frames), " ".join(expected)))
+
+    for key in sorted(worst):
+        print("worst deviation %s: %.0f ns" % (key, worst[key]))
+    for line in errors:
+        print("error: " + line)
+    print("%i frames, %s" % (len(frames), "FAILED" if errors else "ok"))
+    return 1 if errors else 0
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        sys.stderr.write(__doc__)
+        sys.exit(2)
+    sys.exit(main(sys.argv[1], [frame.lower() for frame in sys.argv[2:]]))
@@ -0,0 +1,152 @@
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/avr_mcu_section.h>  // from simavr
+
+#include "usbconfig.h"
+#include "usbdrv.h"
+
+#include "timer.h"
+#include "ws2812b.h"
+
+
+/* Profiling firmware for simavr (see profile_report.py).
+ *
+ * Linked with the firmware's objects (main.c without its main). Calls the
+ * profiled functions the way USB traffic and the main loop would, and
+ * writes the function's number to GPIOR0 around each call. simavr records
+ * GPIOR0 as MARK to profile.vcd.
+ *
+ * The spans include the call overhead, and any timer interrupt that hits
+ * during the call.
+ */
+
+
+AVR_MCU(F_CPU, "attiny85");
+AVR_MCU_VCD_FILE("profile.vcd", 1000);
+
+const struct avr_mmcu_vcd_trace_t _mytrace[] _MMCU_ = {
+  { AVR_MCU_VCD_SYMBOL("MARK"), .what = (void *)&GPIOR0, },
+};
+
+
+// Keep in sync with FUNCTIONS in profile_report.py.
+enum {
+  MARK_NONE,
+  MARK_USB_FUNCTION_SETUP,
+  MARK_USB_FUNCTION_WRITE,
+  MARK_WS2812B_SET_RGB,
+  MARK_TIMER_GET,
+  MARK_TICK,
+};
+
+#define PROFILE(mark, call) do { GPIOR0 = (mark); call; GPIOR0 = MARK_NONE; } while (0)
+
+
+// From main.c
+extern void tick(unsigned long now);
+
+
+static void setup(uint8_t request, uint16_t value, uint16_t index, uint16_t length)
+{
+  // Setup packet plus CRC, as V-USB passes it to usbFunctionSetup
+  uchar data[8 + 2] = {
+    0x40, request,
+    value & 0xff, value >> 8,
+    index & 0xff, index >> 8,
+    length & 0xff, length >> 8,
+  };
+  unsigned crc = usbCrc16(data, 8);
+  data[8] = crc & 0xff;
+  data[9] = crc >> 8;
+
+  PROFILE(MARK_USB_FUNCTION_SETUP, usbFunctionSetup(data));
+}
+
+
+static void data_stage(uchar *data, uchar len)
+{
+  PROFILE(MARK_USB_FUNCTION_WRITE, usbFunctionWrite(data, len));
+}
+
+
+// Runs the main loop for a while.
+static void run(unsigned long ms)
+{
+  unsigned long end = timer_now() + ms;
+  while (1) {
+    time_val_t now;
+    PROFILE(MARK_TIMER_GET, now = timer_get());
+    if (now.updated) {
+      if ((long)(now.time - end) >= 0) {
+        break;
+      }
+      PROFILE(MARK_TICK, tick(now.time));
+    }
+  }
+}
+
+
+int main(void)
+{
+  // LED driver on its own
+  PROFILE(MARK_WS2812B_SET_RGB, ws2812b_set_rgb(0, 0, 0));
+  PROFILE(MARK_WS2812B_SET_RGB, ws2812b_set_rgb(0xffff, 0xffff, 0xffff));
+  PROFILE(MARK_WS2812B_SET_RGB, ws2812b_set_rgb(0x1234, 0x8000, 0xfedc));
+
+  timer_init();
+  sei();
+
+  // Single requests: set and commit a color, then fade
+  setup(3, 0x8000, 0, 0);
+  setup(4, 0x4000, 0, 0);
+  setup(5, 0x2000, 0, 0);
+  setup(1, 0, 0, 0);
+  setup(6, 0xffff, 0, 0);
+  setup(7, 0, 0, 0);
+  setup(8, 0xffff, 0, 0);
+  run(50);
+
+  // Batch: set and commit a color
+  uchar batch[] = {
+    1,
+    3, 0x00, 0x10,
+    4, 0x00, 0x20,
+    5, 0x00, 0x30,
+    1,
+  };
+  setup(11, 0, 0, sizeof(batch));
+  data_stage(batch, 8);
+  data_stage(batch + 8, sizeof(batch) - 8);
+  run(10);
+
+  // Effect: rainbow, 1 s period
+  setup(15, 2 | (128 << 8), 1000, 0);
+  run(50);
+
+  // Blinking and status LED blinking on top of the effect
+  setup(10, 7, 20, 0);
+  setup(2, 2, 0, 0);
+  run(1100);
+
+  // Dithering a dim color
+  setup(10, 0, 0, 0);
+  setup(15, 0, 0, 0);
+  setup(3, 300, 0, 0);
+  setup(4, 200, 0, 0);
+  setup(5, 100, 0, 0);
+  setup(1, 0, 0, 0);
+  setup(22, 1, 1, 0);
+  run(50);
+
+  cli();
+
+  // simavr quits when the CPU sleeps with interrupts disabled
+  sleep_enable();
+  sleep_cpu();
+
+  return 0;
+}
@@ -0,0 +1,106 @@
+"""
+Reports the cycle counts from a profile.vcd trace (see profile.c), and the
+flash and SRAM used per symbol of the firmware.
+
+Usage: profile_report.py <profile.vcd> <main.elf> [--f-cpu HZ] [--tsv FILE]
+
+With --tsv, also writes the numbers as tab separated lines, sorted so
+that runs of different versions can be diffed:
+
+  cycles  <function>  <calls>  <min>  <avg>  <max>
+  flash   <symbol>    <bytes>
+  sram    <symbol>    <bytes>
+"""
+
+import argparse
+import subprocess
+import sys
+
+from vcd import read_changes, intervals
+
+
+# Keep in sync with the MARK_* values in profile.c.
+FUNCTIONS = {
+    1: "usbFunctionSetup",
+    2: "usbFunctionWrite",
+    3: "ws2812b_set_rgb",
+    4: "timer_get",
+    5: "tick",
+}
+
+# avr-nm symbol types. Initialized data takes flash (its initial value)
+# and SRAM.
+FLASH_TYPES = "tTdDrR"
+SRAM_TYPES = "dDbB"
+
+
+def cycles(trace, f_cpu):
+    """Returns {function: [cycles per call]}."""
+    result = {name: [] for name in FUNCTIONS.values()}
+    for start, duration, value in intervals(*read_changes(trace, "MARK")):
+        if value in FUNCTIONS:
+            result[FUNCTIONS[value]].append(int(round(duration * f_cpu / 1e9)))
+    return result
+
+
+def symbols(elf):
+    """Returns {"flash": {symbol: bytes}, "sram": {symbol: bytes}}."""
+    output = subprocess.check_output(["avr-nm", "--print-size", elf]).decode()
+    result = {"flash": {}, "sram": {}}
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) != 4:
+            continue  # no size
+        size, kind, name = int(fields[1], 16), fields[2], fields[3]
+        if kind in FLASH_TYPES:
+            result["flash"][name] = result["flash"].get(name, 0) + size
+        if kind in SRAM_TYPES:
+            result["sram"][name] = result["sram"].get(name, 0) + size
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("trace")
+    parser.add_argument("elf")
+    parser.add_argument("--f-cpu", type=float, default=16.5e6)
+    parser.add_argument("--tsv")
+    args = parser.parse_args()
+
+    calls = cycles(args.trace, args.f_cpu)
+    sizes = symbols(args.elf)
+    lines = []
+
+    print("%-20s %6s %8s %8s %8s %10s" % ("function", "calls", "min", "avg", "max", "max (us)"))
+    for name in sorted(calls):
+        counts = calls[name]
+        if not counts:
+            print("%-20s %6i" % (name, 0))
+            lines.append("cycles\t%s\t0\t-\t-\t-" % name)
+            continue
+        low, avg, high = min(counts), sum(counts) // len(counts), max(counts)
+        print("%-20s %6i %8i %8i %8i %10.1f" % (name, len(counts), low, avg, high, high * 1e6 / args.f_cpu))
+        lines.append("cycles\t%s\t%i\t%i\t%i\t%i" % (name, len(counts), low, avg, high))
+
+    for memory in ("flash", "sram"):
+        table = sizes[memory]
+        print("")
+        print("%s: %i bytes in symbols" % (memory, sum(table.values())))
+        for name, size in sorted(table.items(), key=lambda item: (-item[1], item[0])):
+            print("  %-30s %6i" % (name, size))
+        for name in sorted(table):
+            lines.append("%s\t%s\t%i" % (memory, name, table[name]))
+
+    if args.tsv:
+        with open(args.tsv, "w") as f:
+            f.write("\n".join(lines) + "\n")
+
+    missing = [name for name in sorted(calls) if not calls[name]]
+    if missing:
+        print("error: no calls of %s in the trace" % ", ".join(missing))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
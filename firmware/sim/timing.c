@@ -0,0 +1,53 @@
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+#include <stdint.h>
+#include <util/delay.h>
+
+#include <avr/avr_mcu_section.h>  // from simavr
+
+#include "ws2812b.h"
+
+
+/* WS2812B waveform test firmware for simavr (see check_timing.py).
+ *
+ * Sends a few known frames and stops. simavr records PB3 to timing.vcd,
+ * and GPIOR0 as DONE to mark the end of the trace.
+ */
+
+
+AVR_MCU(F_CPU, "attiny85");
+AVR_MCU_VCD_FILE("timing.vcd", 1000);
+
+const struct avr_mmcu_vcd_trace_t _mytrace[] _MMCU_ = {
+  { AVR_MCU_VCD_SYMBOL("PB3"), .mask = (1 << PB3), .what = (void *)&PORTB, },
+  { AVR_MCU_VCD_SYMBOL("DONE"), .what = (void *)&GPIOR0, },
+};
+
+
+// Keep in sync with the check-timing target in the Makefile.
+static const uint8_t frames[][3] = {
+  { 0xaa, 0x55, 0x0f },
+  { 0xf0, 0x00, 0xff },
+  { 0xff, 0xff, 0xff },
+};
+
+
+int main(void)
+{
+  for (uint8_t i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+    ws2812b_write(frames[i], sizeof(frames[i]));
+  }
+
+  // The driver doesn't wait for the latch after the last frame.
+  _delay_us(100);
+
+  GPIOR0 = 1;
+
+  // simavr quits when the CPU sleeps with interrupts disabled
+  cli();
+  sleep_enable();
+  sleep_cpu();
+
+  return 0;
+}
@@ -0,0 +1,62 @@
+"""
+Minimal VCD (value change dump) reader for the traces simavr writes.
+"""
+
+import re
+
+
+UNITS = {"s": 1e9, "ms": 1e6, "us": 1e3, "ns": 1.0, "ps": 1e-3, "fs": 1e-6}
+
+
+def read_changes(path, signal):
+    """
+    Returns the value changes of a signal as a list of (time in ns, value)
+    tuples, and the time of the last change of any signal in the trace.
+    The signal is matched by its name (e.g. "PB3").
+    """
+    with open(path) as f:
+        text = f.read()
+
+    header, _, body = text.partition("$enddefinitions")
+
+    match = re.search(r"\$timescale\s+(\d+)\s*(\w+)\s+\$end", header)
+    scale = int(match.group(1)) * UNITS[match.group(2)] if match else 1.0
+
+    ids = [m.group(1) for m in re.finditer(r"\$var\s+\S+\s+\d+\s+(\S+)\s+(\S+)", header)
+           if m.group(2) == signal]
+    if not ids:
+        raise ValueError("signal %s not found in %s" % (signal, path))
+    ident = ids[0]
+
+    changes = []
+    time = 0
+    for token in body.split():
+        if token.startswith("#"):
+            time = int(token[1:]) * scale
+        elif token.startswith("b"):
+            value = token[1:]
+        elif token[1:] == ident and token[0] in "01xz":
+            value = token[0]
+            changes.append((time, int(value) if value in "01" else 0))
+        elif token == ident:
+            # multi-bit value: the preceding "b..." token holds it
+            changes.append((time, int(value, 2) if set(value) <= set("01") else 0))
+    return changes, time
+
+
+def intervals(changes, end):
+    """
+    Returns (start, duration, value) tuples for the stretches between changes
+    up to the end time, dropping changes that don't change the value.
+    """
+    result = []
+    last_time, last_value = None, None
+    for time, value in changes:
+        if value == last_value:
+            continue
+        if last_time is not None:
+            result.append((last_time, time - last_time, last_value))
+        last_time, last_value = time, value
+    if last_time is not None and end > last_time:
+        result.append((last_time, end - last_time, last_value))
+    return result
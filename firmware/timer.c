@@ -7,14 +7,47 @@
 #include "timer.h"
 
 
+// Timer1 counts per millisecond: 16.5 MHz (Clock) / 128 (Prescaler) / 1000
+// (ms/s) = 128.90625 = 128 + 29/32. Each millisecond is 128 or 129 counts
+// long, so that they average out exactly.
+#define TIMER_COUNTS        128
+#define TIMER_FRACTION      29  // in 1/32 counts
+
+// Clock offsets up to this many ms are slewed (see timer_sync), by one
+// count (0.78%) per millisecond; larger ones are stepped.
+#define TIMER_SLEW_MAX      250
+
+
 volatile time_val_t time_val;
 
+static uint8_t fraction;  // in 1/32 counts, see TIMER_FRACTION
+static volatile int16_t slew;  // counts to make up (> 0) or drop (< 0)
+
 
-/* Triggered every ~1ms. */
-ISR(TIMER1_COMPA_vect)
+/* Triggered every ~1ms.
+ *
+ * Sets the length of the next millisecond. Interruptible, as V-USB needs.
+ */
+ISR(TIMER1_COMPA_vect, ISR_NOBLOCK)
 {
   time_val.time++;
   time_val.updated = true;
+
+  uint8_t counts = TIMER_COUNTS;
+  fraction += TIMER_FRACTION;
+  if (fraction >= 32) {
+    fraction -= 32;
+    counts++;
+  }
+  if (slew > 0) {
+    slew--;
+    counts--;
+  } else if (slew < 0) {
+    slew++;
+    counts++;
+  }
+  OCR1A = counts - 1;  // Have compare match after <counts> counts
+  OCR1C = counts - 1;  // Reset to 0 after <counts> counts (note: not an overflow)
 }
 
 void timer_init()
@@ -22,10 +55,10 @@ void timer_init()
   // Clear Timer on Compare (CTC) (with OCR1C) | /128 Prescaler
   TCCR1 = (1<<CTC1) | (1<<CS13);
 
-  // Compare match
-  // #Counts = 16.5 MHz (Clock) / 128 (Prescaler) / 1000 (ms/s) = 128.90625 = 129
-  OCR1A = 129 - 1;  // Have compare match after 129 counts (0...128)
-  OCR1C = 129 - 1;  // Reset to 0 after 129 counts (note: not an overflow)
+  // Compare match at the end of each millisecond (the ISR sets the
+  // length of the next one, see TIMER_COUNTS)
+  OCR1A = TIMER_COUNTS;  // 129 counts for the first millisecond
+  OCR1C = TIMER_COUNTS;
 
   // Enable Compare Match interrupt
   TIMSK |= (1 << OCIE1A);
@@ -36,6 +69,16 @@ bool timer_updated()
   return time_val.updated;
 }
 
+/* Returns current timer value without consuming the update flag. */
+unsigned long timer_now()
+{
+    unsigned long result;
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      result = time_val.time;
+    }
+    return result;
+}
+
 /* Returns current timer value with millisecond precision.
  *
  * Overflows to 0 after 2^32 ms (~ 49 days).
@@ -51,3 +94,44 @@ time_val_t timer_get()
     return result;
 }
 
+
+/* Sets the clock to <time>, e.g. for several devices to share a time
+ * base. If it is off by at most TIMER_SLEW_MAX ms, it is slewed there
+ * (gradually, over up to 129 times the offset), so that it never jumps.
+ * Otherwise it is stepped.
+ *
+ * Returns the step in ms (0 if slewed), for times kept in the clock's
+ * base to be moved along.
+ */
+long timer_sync(unsigned long time)
+{
+    long step = 0;
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      long offset = time - time_val.time;
+      if (offset > TIMER_SLEW_MAX || offset < -TIMER_SLEW_MAX) {
+        time_val.time = time;
+        slew = 0;
+        step = offset;
+      } else {
+        slew = offset * (TIMER_COUNTS + 1);
+      }
+    }
+    return step;
+}
+
+/* Returns a timestamp in timer counts (7.76us), for measuring intervals
+ * up to 0.5s.
+ */
+uint16_t timer_counts()
+{
+    uint16_t ms;
+    uint8_t count;
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      ms = time_val.time;
+      count = TCNT1;
+      if ((TIFR & (1 << OCF1A)) && count < TIMER_COUNTS / 2) {
+        ms++;  // the counter was reset, but the ISR didn't run yet
+      }
+    }
+    return ms * (TIMER_COUNTS + 1) + count;
+}
@@ -8,5 +8,8 @@ typedef struct {
 
 void timer_init();
 time_val_t timer_get();
+unsigned long timer_now();
+long timer_sync(unsigned long time);
+uint16_t timer_counts();
 
 #endif
@@ -1,6 +1,22 @@
 #ifndef _WS2812B_H
 #define _WS2812B_H
 
-void ws2812b_set_rgb(uint16_t r, uint16_t g, uint16_t b);
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of daisy-chained WS2812Bs.
+#ifndef WS2812B_NUM_PIXELS
+#define WS2812B_NUM_PIXELS 1
+#endif
+
+// Transmissions to the chain, and those of them interrupted (and sent
+// again), for statistics. Wrap around.
+extern uint16_t ws2812b_sent, ws2812b_interrupted;
+
+uint8_t ws2812b_gamma(uint16_t value);
+uint16_t ws2812b_gamma16(uint16_t value);
+bool ws2812b_set_rgb(uint16_t r, uint16_t g, uint16_t b);
+bool ws2812b_set_grb(const uint8_t grb[3]);
+bool ws2812b_write(const uint8_t *grb, uint16_t length);
 
 #endif
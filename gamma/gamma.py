@@ -8,67 +8,195 @@ Calculates a gamma correction table with the following properties.
 Having even just one more bit for inputs than for outputs increases
 the output value coverage significantly, for example from 128 to 252
 for 8/9 bit inputs and 8 bit outputs.
+
+Writes a C header for the firmware (see firmware/Makefile) defining
+GAMMA_INPUT_BITS, GAMMA_OUTPUT_BITS and gamma_lookup(), in one of two
+formats:
+
+- table: the plain table, one byte per input value.
+- compact: the table split into blocks of 2^n entries, stored as one base
+  byte per block and one nibble per entry (its offset from the base). The
+  largest block size whose offsets all fit into a nibble is used. Lossless;
+  decoding takes two table reads and a few shifts.
 """
 
+import argparse
 import itertools
 import math
 import sys
 
 
-# Gamma exponent. 2.5 is a good choice.
-GAMMA = 2.5
-
-# Number of input values. Should be a power of two.
-STEPS = 2**9
-
-# Highest output value. Should be one less than a power of two.
-MAXIMUM = 2**8 - 1
-
-# Maps fractions to output values.
-# Start with highest desired output value.
-# If the last entry in the generated table is less than the highest output value,
-# try increasing it.
-MULTIPLIER = 256
-
-
 # Gamma correction
-gamma = lambda step, steps: ((step/float(steps)) ** GAMMA) * MULTIPLIER
-
-# Determine best range (elide all but one initial 0x00 outputs)
-for null_steps in itertools.count():
-    steps = STEPS - 1 + null_steps
-    if int(round(gamma(null_steps, steps))) > 0:
-        break
-else:
-    assert False
-
-# Build table
-float_table = [0.0]
-table = [0]
-for step in range(null_steps, steps):
-    value = gamma(step, steps)
-    float_table.append(value)
-    table.append(int(round(value)))
-
-# Convert to C code
-print("uint8_t gamma[%i] = {" % len(table))
-line_width = 8
-num_width = int(math.ceil(math.log(table[-1], 2**4)))
-line_format = " " * 2 + ", ".join(["0x%%0%ix" % num_width] * line_width) + "," + " // 0x%03x"
-for line_begin in range(0, len(table), line_width):
-    line = tuple(table[line_begin:line_begin+line_width]) + (line_begin,)
-    print(line_format % line)
-print("}")
-
-# Check correctness
-last_i = -1
-for i in table:
-    assert i >= last_i
-    last_i = i
-assert table[1] > 0
-
-# Show statistics
-sys.stderr.write("Elided null outputs: %i\n" % (null_steps-1))
-sys.stderr.write("Maximum output: %i\n" % table[-1])
-sys.stderr.write("Unique output: %i\n" % len(set(table)))
-
+gamma = lambda step, steps, exponent, multiplier: ((step/float(steps)) ** exponent) * multiplier
+
+
+def build_table(exponent, input_bits, output_bits, multiplier):
+    """
+    Returns the table for 2^input_bits input values.
+    """
+    num_steps = 2**input_bits
+
+    # Determine best range (elide all but one initial 0x00 outputs)
+    for null_steps in itertools.count():
+        steps = num_steps - 1 + null_steps
+        if int(round(gamma(null_steps, steps, exponent, multiplier))) > 0:
+            break
+    else:
+        assert False
+
+    # Build table
+    table = [0]
+    for step in range(null_steps, steps):
+        table.append(min(int(round(gamma(step, steps, exponent, multiplier))), 2**output_bits - 1))
+
+    # Check correctness
+    assert len(table) == num_steps
+    last_i = -1
+    for i in table:
+        assert i >= last_i
+        last_i = i
+    assert table[1] > 0
+
+    # Show statistics
+    sys.stderr.write("Elided null outputs: %i\n" % (null_steps-1))
+    sys.stderr.write("Maximum output: %i\n" % table[-1])
+    sys.stderr.write("Unique output: %i\n" % len(set(table)))
+
+    return table
+
+
+def compact(table):
+    """
+    Returns (block_bits, bases, nibbles) of the compact format.
+    """
+    for block_bits in reversed(range(1, int(math.log(len(table), 2)))):
+        size = 2**block_bits
+        blocks = [table[i:i+size] for i in range(0, len(table), size)]
+        if all(block[-1] - block[0] < 16 for block in blocks):
+            break
+    else:
+        raise ValueError("table too steep for the compact format")
+
+    bases = [block[0] for block in blocks]
+    offsets = [value - bases[i >> block_bits] for i, value in enumerate(table)]
+    nibbles = [offsets[i] | (offsets[i+1] << 4) for i in range(0, len(offsets), 2)]
+    return block_bits, bases, nibbles
+
+
+def decode_compact(block_bits, bases, nibbles, i):
+    """
+    Same as gamma_lookup() in the compact header.
+    """
+    nibble = nibbles[i >> 1]
+    if i & 1:
+        nibble >>= 4
+    return bases[i >> block_bits] + (nibble & 0x0f)
+
+
+def c_array(name, values, comment_step=1):
+    """
+    Returns a PROGMEM array definition, 8 values per line.
+    """
+    line_width = 8
+    num_width = max(2, int(math.ceil(math.log(max(values) + 1, 2**4))))
+    lines = ["PROGMEM static const uint8_t %s[%i] = {" % (name, len(values))]
+    for line_begin in range(0, len(values), line_width):
+        items = values[line_begin:line_begin+line_width]
+        line = " " * 2 + ", ".join(("0x%%0%ix" % num_width) % v for v in items) + ","
+        lines.append(line + " // 0x%03x" % (line_begin * comment_step))
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def header(args, table):
+    out = []
+    out.append("// Generated by gamma/gamma.py, do not edit:")
+    out.append("// gamma %s, %i bit input, %i bit output, %s format" % (
+        args.gamma, args.input_bits, args.output_bits, args.format))
+    out.append("")
+    out.append("#ifndef _GAMMA_H")
+    out.append("#define _GAMMA_H")
+    out.append("")
+    out.append("#include <avr/pgmspace.h>")
+    out.append("#include <stdint.h>")
+    out.append("")
+    out.append("#define GAMMA_INPUT_BITS   %i" % args.input_bits)
+    out.append("#define GAMMA_OUTPUT_BITS  %i" % args.output_bits)
+    out.append("")
+
+    if args.format == "table":
+        out.append(c_array("GAMMA", table))
+        out.append("")
+        out.append("// gamma_lookup returns the output value for input i.")
+        out.append("static inline uint8_t gamma_lookup(uint16_t i)")
+        out.append("{")
+        out.append("  return pgm_read_byte_near(GAMMA + i);")
+        out.append("}")
+    else:
+        block_bits, bases, nibbles = compact(table)
+
+        # Accuracy test: the compact format must decode to the full table.
+        for i, value in enumerate(table):
+            assert decode_compact(block_bits, bases, nibbles, i) == value
+
+        sys.stderr.write("Compact size: %i bytes (table: %i bytes), %i entries per block\n" % (
+            len(bases) + len(nibbles), len(table), 2**block_bits))
+
+        out.append("// Blocks of 2^GAMMA_BLOCK_BITS entries: a base value per block, and")
+        out.append("// each entry's offset from its block's base (a nibble, low one first).")
+        out.append("#define GAMMA_BLOCK_BITS   %i" % block_bits)
+        out.append("")
+        out.append(c_array("GAMMA_BASES", bases, 2**block_bits))
+        out.append("")
+        out.append(c_array("GAMMA_NIBBLES", nibbles, 2))
+        out.append("")
+        out.append("// gamma_lookup returns the output value for input i.")
+        out.append("static inline uint8_t gamma_lookup(uint16_t i)")
+        out.append("{")
+        out.append("  uint8_t nibble = pgm_read_byte_near(GAMMA_NIBBLES + (i >> 1));")
+        out.append("  if (i & 1) {")
+        out.append("    nibble >>= 4;")
+        out.append("  }")
+        out.append("  return pgm_read_byte_near(GAMMA_BASES + (i >> GAMMA_BLOCK_BITS)) + (nibble & 0x0f);")
+        out.append("}")
+
+    out.append("")
+    out.append("#endif")
+    return "\n".join(out) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generates a gamma correction table header.")
+    parser.add_argument("--gamma", type=float, default=2.5,
+        help="gamma exponent (default: 2.5, a good choice)")
+    parser.add_argument("--input-bits", type=int, default=9,
+        help="bits of input, i.e. log2 of the table length (default: 9)")
+    parser.add_argument("--output-bits", type=int, default=8,
+        help="bits of output (default: 8)")
+    parser.add_argument("--multiplier", type=float,
+        help="maps fractions to output values (default: 2^output-bits). "
+             "If the last table entry is less than the highest output value, "
+             "try increasing it.")
+    parser.add_argument("--format", choices=["table", "compact"], default="table")
+    parser.add_argument("--output", "-o", help="header to write (default: stdout)")
+    args = parser.parse_args()
+
+    if not 1 <= args.output_bits <= 8:
+        parser.error("output bits must be 1-8")
+    if args.format == "compact" and args.input_bits < 2:
+        parser.error("the compact format needs at least 2 input bits")
+    if args.multiplier is None:
+        args.multiplier = 2**args.output_bits
+
+    table = build_table(args.gamma, args.input_bits, args.output_bits, args.multiplier)
+    text = header(args, table)
+
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "color.h"
+
+
+/* Host-side color pipeline for frames.
+ *
+ * Converts 8 bit red/green/blue input values (like the device's frame
+ * buffer takes them) into corrected 8 bit output values, which the device
+ * passes through to the LEDs unchanged (OPTION_PASSTHROUGH):
+ *
+ *   1. gamma: input value -> linear light (lookup table)
+ *   2. calibration matrix and white balance (one 3x3 matrix)
+ *   3. brightness limit (scales the whole frame)
+ *   4. linear light -> output value
+ *
+ * Steps 2-4 work on all three channels of a pixel at once (color_v4f).
+ */
+
+
+void color_pipeline_init(color_pipeline_t *pipeline)
+{
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->gamma = 2.5;  // same as the firmware's table
+  for (int i = 0; i < 3; i++) {
+    pipeline->white[i] = 1;
+    pipeline->matrix[i][i] = 1;
+  }
+  pipeline->limit = 1;
+  color_pipeline_update(pipeline);
+}
+
+void color_pipeline_update(color_pipeline_t *pipeline)
+{
+  for (int i = 0; i < 256; i++) {
+    pipeline->linear[i] = powf(i / 255.0f, pipeline->gamma);
+  }
+  for (int column = 0; column < 3; column++) {
+    for (int row = 0; row < 3; row++) {
+      pipeline->columns[column][row] = pipeline->white[row] * pipeline->matrix[row][column];
+    }
+    pipeline->columns[column][3] = 0;
+  }
+}
+
+/* Returns the settings file: $USB_LED_COLOR, or ~/.config/usb-led/color.
+ */
+const char* color_pipeline_path()
+{
+  static char path[512];
+  const char *env = getenv("USB_LED_COLOR");
+  if (env != NULL && *env != '\0') {
+    return env;
+  }
+  const char *home = getenv("HOME");
+  snprintf(path, sizeof(path), "%s/.config/usb-led/color", home ? home : ".");
+  return path;
+}
+
+/* Reads settings from a file, one per line ('#' starts a comment):
+ *
+ *   gamma <exponent>
+ *   white <r> <g> <b>
+ *   matrix <r.r> <r.g> <r.b> <g.r> <g.g> <g.b> <b.r> <b.g> <b.b>
+ *   limit <fraction>
+ *
+ * Missing settings keep their values. A missing file is not an error.
+ * Prints an error message and returns false if the file is invalid.
+ */
+bool color_pipeline_load(color_pipeline_t *pipeline, const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    if (errno == ENOENT) return true;
+    printf("error: %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  char line[256];
+  int line_number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f) != NULL) {
+    line_number++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL) *comment = '\0';
+
+    char name[16];
+    float v[9];
+    int n = sscanf(line, "%15s %f %f %f %f %f %f %f %f %f",
+        name, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8]);
+    if (n <= 0) {
+      continue;  // empty line
+    } else if (0 == strcmp("gamma", name) && n == 2 && v[0] > 0) {
+      pipeline->gamma = v[0];
+    } else if (0 == strcmp("white", name) && n == 4) {
+      memcpy(pipeline->white, v, sizeof(pipeline->white));
+    } else if (0 == strcmp("matrix", name) && n == 10) {
+      memcpy(pipeline->matrix, v, sizeof(pipeline->matrix));
+    } else if (0 == strcmp("limit", name) && n == 2 && v[0] >= 0 && v[0] <= 1) {
+      pipeline->limit = v[0];
+    } else {
+      printf("error: %s:%i: invalid setting\n", path, line_number);
+      ok = false;
+    }
+  }
+  fclose(f);
+
+  color_pipeline_update(pipeline);
+  return ok;
+}
+
+/* Converts <count> pixels of 8 bit red/green/blue input values into output
+ * values for the LEDs (see above). rgb_in and rgb_out may be the same.
+ *
+ * Like the firmware's gamma table, only black maps to 0.
+ *
+ * Returns false if out of memory.
+ */
+bool color_convert(const color_pipeline_t *pipeline,
+  const uint8_t *rgb_in, uint8_t *rgb_out, size_t count)
+{
+  // (Vector types need their alignment, which malloc may not give.)
+  color_v4f *pixels;
+  if (posix_memalign((void **)&pixels, sizeof(color_v4f),
+        (count ? count : 1) * sizeof(color_v4f)) != 0) {
+    return false;
+  }
+
+  // Linear light, calibrated
+  color_v4f total = { 0, 0, 0, 0 };
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t *p = rgb_in + 3 * i;
+    color_v4f pixel = pipeline->columns[0] * pipeline->linear[p[0]]
+        + pipeline->columns[1] * pipeline->linear[p[1]]
+        + pipeline->columns[2] * pipeline->linear[p[2]];
+    pixels[i] = pixel;
+    total += pixel;
+  }
+
+  // Brightness limit
+  float average = (total[0] + total[1] + total[2]) / (3.0f * (count ? count : 1));
+  float scale = 255;
+  if (average > pipeline->limit) {
+    scale *= pipeline->limit / average;
+  }
+
+  // Output values
+  for (size_t i = 0; i < count; i++) {
+    color_v4f pixel = pixels[i] * scale + 0.5f;
+    uint8_t *p = rgb_out + 3 * i;
+    for (int c = 0; c < 3; c++) {
+      if (pixel[c] >= 255) {
+        p[c] = 255;
+      } else if (pixel[c] >= 1) {
+        p[c] = (uint8_t)pixel[c];
+      } else {
+        p[c] = pixels[i][c] > 0;  // dim, not off
+      }
+    }
+  }
+
+  free(pixels);
+  return true;
+}
+
+/* Converts hue (degrees), saturation and value (0-1) to red/green/blue
+ * (0-1).
+ */
+void color_hsv_to_rgb(float h, float s, float v, float rgb[3])
+{
+  float chroma = v * s;
+  h = fmodf(h, 360);
+  if (h < 0) h += 360;
+  float x = chroma * (1 - fabsf(fmodf(h / 60, 2) - 1));
+  float m = v - chroma;
+  float r, g, b;
+  switch ((int)(h / 60)) {
+    case 0:  r = chroma; g = x; b = 0; break;
+    case 1:  r = x; g = chroma; b = 0; break;
+    case 2:  r = 0; g = chroma; b = x; break;
+    case 3:  r = 0; g = x; b = chroma; break;
+    case 4:  r = x; g = 0; b = chroma; break;
+    default: r = chroma; g = 0; b = x; break;
+  }
+  rgb[0] = r + m;
+  rgb[1] = g + m;
+  rgb[2] = b + m;
+}
@@ -0,0 +1,33 @@
+#ifndef _COLOR_H
+#define _COLOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Four floats processed at once (SSE/NEON where available).
+typedef float color_v4f __attribute__((vector_size(16)));
+
+typedef struct {
+  // Settings (see color_pipeline_load)
+  float gamma;          // exponent: input value -> linear light
+  float white[3];       // white balance: red/green/blue gains
+  float matrix[3][3];   // calibration: linear rgb -> linear rgb
+  float limit;          // brightness limit: max. average of all channels, 0-1
+
+  // Derived from the settings by color_pipeline_update
+  float linear[256];    // input value -> linear light
+  color_v4f columns[3];  // matrix columns, white balance applied
+} color_pipeline_t;
+
+void color_pipeline_init(color_pipeline_t *pipeline);
+bool color_pipeline_load(color_pipeline_t *pipeline, const char *path);
+void color_pipeline_update(color_pipeline_t *pipeline);
+const char* color_pipeline_path();
+
+bool color_convert(const color_pipeline_t *pipeline,
+  const uint8_t *rgb_in, uint8_t *rgb_out, size_t count);
+
+void color_hsv_to_rgb(float h, float s, float v, float rgb[3]);
+
+#endif
@@ -0,0 +1,358 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "command.h"
+
+// Time a sync request takes to reach the device, in ms (about one USB frame).
+#define SYNC_LATENCY 1
+
+
+uint16_t str_to_uint16(char *str) {
+  errno = 0;
+  char *endptr;
+  long val = strtol(str, &endptr, 0);
+  if (errno != 0) {
+    return 0;
+  } else if (*endptr != '\0') {
+    errno = EINVAL;
+    return 0;
+  } else if (val < 0 || val > 65535) {
+    errno = EINVAL;
+    return 0;
+  }
+  return val;
+}
+
+
+/* Parses a duration: milliseconds, or a number followed by one of the
+ * units ms, s, m and h. Sets errno and returns 0 if it's invalid.
+ */
+unsigned long str_to_duration(char *str) {
+  errno = 0;
+  char *endptr;
+  unsigned long val = strtoul(str, &endptr, 10);
+  unsigned long factor;
+  if (errno != 0) {
+    return 0;
+  } else if (endptr == str || *str == '-') {
+    errno = EINVAL;
+    return 0;
+  } else if (*endptr == '\0' || 0 == strcmp("ms", endptr)) {
+    factor = 1;
+  } else if (0 == strcmp("s", endptr)) {
+    factor = 1000;
+  } else if (0 == strcmp("m", endptr)) {
+    factor = 60 * 1000;
+  } else if (0 == strcmp("h", endptr)) {
+    factor = 60 * 60 * 1000;
+  } else {
+    errno = EINVAL;
+    return 0;
+  }
+  if (val > 0xffffffffUL / factor) {
+    errno = EINVAL;
+    return 0;
+  }
+  return val * factor;
+}
+
+
+/* Returns the time base shared by synchronized devices (see the sync
+ * command): the wall clock in ms, modulo 2^32. Hosts running NTP agree
+ * on it, too.
+ */
+unsigned long sync_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (unsigned long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/* Translates a command line (argv[1] being the command) into a batch of
+ * requests. Prints an error message and returns false if it's invalid.
+ *
+ * Used by both the tool and the daemon.
+ */
+bool parse_command(int argc, char **argv, batch_t *batch)
+{
+  batch_init(batch);
+
+  if (argc == 2 && 0 == strcmp("off", argv[1])) {
+    batch_add(batch, 0, 0, 0);  // Turn off immediately
+    return true;
+
+  } else if (argc == 5 && 0 == strcmp("set", argv[1])) {
+
+    int e = 0;
+    uint16_t r = str_to_uint16(argv[2]); e |= errno;
+    uint16_t g = str_to_uint16(argv[3]); e |= errno;
+    uint16_t b = str_to_uint16(argv[4]); e |= errno;
+    if (e != 0) {
+      printf("error: values must be numbers in range 0-65535\n");
+      return false;
+    }
+
+    batch_add(batch, 3, r, 0);  // Set red
+    batch_add(batch, 4, g, 0);  // Set green
+    batch_add(batch, 5, b, 0);  // Set blue
+    batch_add(batch, 1, 0, 0);  // Commit
+    return true;
+
+  } else if ((argc == 5 || argc == 6) && 0 == strcmp("fade", argv[1])) {
+    int speed;
+    if (argc == 6) {
+      speed = str_to_uint16(argv[5]);
+      if (errno != 0) {
+        printf("error: values must be numbers in range 0-65535\n");
+        return false;
+      }
+    } else {
+      speed = 256;
+    }
+
+    int e = 0;
+    uint16_t r = str_to_uint16(argv[2]); e |= errno;
+    uint16_t g = str_to_uint16(argv[3]); e |= errno;
+    uint16_t b = str_to_uint16(argv[4]); e |= errno;
+    if (e != 0) {
+      printf("error: values must be numbers in range 0-65535\n");
+      return false;
+    }
+
+    batch_add(batch, 9, speed, 0);  // Set fade speed
+    batch_add(batch, 6, r, 0);  // Fade red to r
+    batch_add(batch, 7, g, 0);  // Fade green to g
+    batch_add(batch, 8, b, 0);  // Fade blue to b
+    return true;
+
+  } else if (argc == 7 && 0 == strcmp("fade", argv[1]) && 0 == strcmp("in", argv[5])) {
+    int e = 0;
+    uint16_t r = str_to_uint16(argv[2]); e |= errno;
+    uint16_t g = str_to_uint16(argv[3]); e |= errno;
+    uint16_t b = str_to_uint16(argv[4]); e |= errno;
+    if (e != 0) {
+      printf("error: values must be numbers in range 0-65535\n");
+      return false;
+    }
+
+    unsigned long duration = str_to_duration(argv[6]);
+    if (errno != 0) {
+      printf("error: duration must be a number of ms, s, m or h (at most 49 days)\n");
+      return false;
+    }
+
+    batch_add(batch, 6, r, 0);  // Fade red to r
+    batch_add(batch, 7, g, 0);  // Fade green to g
+    batch_add(batch, 8, b, 0);  // Fade blue to b
+    batch_add(batch, 21, duration & 0xffff, duration >> 16);  // ... in duration ms
+    return true;
+
+  } else if ((argc == 6 && 0 == strcmp("pixel", argv[1]))
+      || (argc == 7 && 0 == strcmp("fill", argv[1]))) {
+
+    // pixel <i> <r> <g> <b> is fill <i> 1 <r> <g> <b>
+    bool fill = argc == 7;
+    int e = 0;
+    uint16_t first = str_to_uint16(argv[2]); e |= errno;
+    uint16_t count = fill ? str_to_uint16(argv[3]) : 1; e |= errno;
+    uint16_t r = str_to_uint16(argv[3 + fill]); e |= errno;
+    uint16_t g = str_to_uint16(argv[4 + fill]); e |= errno;
+    uint16_t b = str_to_uint16(argv[5 + fill]); e |= errno;
+    if (e != 0) {
+      printf("error: values must be numbers in range 0-65535\n");
+      return false;
+    }
+
+    batch_add(batch, 27, r, 0);  // Set fill red
+    batch_add(batch, 28, g, 0);  // Set fill green
+    batch_add(batch, 29, b, 0);  // Set fill blue
+    batch_add(batch, 12, first, count);  // Fill pixels
+    batch_add(batch, 13, 0, 0);  // Show frame buffer
+    return true;
+
+  } else if (argc == 3 && 0 == strcmp("effect", argv[1]) && 0 == strcmp("off", argv[2])) {
+    batch_add(batch, 15, 0, 0);  // Stop effect
+    return true;
+
+  } else if ((argc == 4 || argc == 7 || argc == 10) && 0 == strcmp("effect", argv[1])) {
+    static const char *effects[] = { "breathe", "rainbow", "strobe", "alternate" };
+    uint8_t type = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+      if (0 == strcmp(effects[i], argv[2])) type = i + 1;
+    }
+    if (type == 0) {
+      print_usage();
+      return false;
+    }
+
+    // Colors default to full white and off
+    uint16_t color[6] = { 65535, 65535, 65535, 0, 0, 0 };
+    int e = 0;
+    uint16_t period = str_to_uint16(argv[3]); e |= errno;
+    for (int i = 0; i < argc - 4; i++) {
+      color[i] = str_to_uint16(argv[4 + i]); e |= errno;
+    }
+    if (e != 0 || period == 0) {
+      printf("error: values must be numbers in range 0-65535 (period at least 1)\n");
+      return false;
+    }
+
+    batch_add(batch, 3, color[0], 0);  // Set red
+    batch_add(batch, 4, color[1], 0);  // Set green
+    batch_add(batch, 5, color[2], 0);  // Set blue
+    batch_add(batch, 16, color[3], 0);  // Set secondary red
+    batch_add(batch, 17, color[4], 0);  // Set secondary green
+    batch_add(batch, 18, color[5], 0);  // Set secondary blue
+    batch_add(batch, 15, type, period);  // Start effect
+    return true;
+
+  } else if (argc == 3 && 0 == strcmp("blink", argv[1]) && 0 == strcmp("off", argv[2])) {
+    batch_add(batch, 10, 0, 0);  // Disable blinking
+    return true;
+
+  } else if ((argc == 3 || argc == 4 || argc == 6 || argc == 7) && 0 == strcmp("blink", argv[1])) {
+    long duty = 0, period = 0;
+    bool has_period = (argc == 4 || argc == 7);
+    bool has_color = (argc >= 6);
+
+    duty = str_to_uint16(argv[2]);
+    if (errno != 0 || duty < 0 || duty > 65535) {
+      printf("error: values must be numbers in range 0-65535\n");
+      return false;
+    }
+
+    if (has_period) {
+      period = str_to_uint16(argv[3]);
+      if (errno != 0 || period < 0 || period > 65535) {
+        printf("error: values must be numbers in range 0-65535\n");
+        return false;
+      } else if (duty > period) {
+        printf("error: duty time must be less than or equal to period\n");
+        return false;
+      }
+    } else {
+      period = duty;
+      duty /= 2;
+    }
+
+    // Optional color, in the same batch, so the LED doesn't blink the
+    // old one first
+    if (has_color) {
+      int e = 0;
+      uint16_t r = str_to_uint16(argv[argc - 3]); e |= errno;
+      uint16_t g = str_to_uint16(argv[argc - 2]); e |= errno;
+      uint16_t b = str_to_uint16(argv[argc - 1]); e |= errno;
+      if (e != 0) {
+        printf("error: values must be numbers in range 0-65535\n");
+        return false;
+      }
+
+      batch_add(batch, 3, r, 0);  // Set red
+      batch_add(batch, 4, g, 0);  // Set green
+      batch_add(batch, 5, b, 0);  // Set blue
+      batch_add(batch, 1, 0, 0);  // Commit
+    }
+
+    batch_add(batch, 10, duty, period);  // Set blink params
+    return true;
+
+  } else if (argc == 3 && 0 == strcmp("status", argv[1]) && 0 == strcmp("on", argv[2])) {
+    batch_add(batch, 2, 1, 0);  // Set status
+    batch_add(batch, 1, 0, 0);  // Commit
+    return true;
+
+  } else if (argc == 3 && 0 == strcmp("status", argv[1]) && 0 == strcmp("off", argv[2])) {
+    batch_add(batch, 2, 0, 0);  // Set status
+    batch_add(batch, 1, 0, 0);  // Commit
+    return true;
+
+  } else if (argc == 3 && 0 == strcmp("status", argv[1]) && 0 == strcmp("blink", argv[2])) {
+    batch_add(batch, 2, 2, 0);  // Set status
+    batch_add(batch, 1, 0, 0);  // Commit
+    return true;
+
+  } else if (argc == 3 && 0 == strcmp("dither", argv[1])
+      && (0 == strcmp("on", argv[2]) || 0 == strcmp("off", argv[2]))) {
+    bool on = 0 == strcmp("on", argv[2]);
+    batch_add(batch, 22, on ? OPTION_DITHER : 0, OPTION_DITHER);  // Set option
+    return true;
+
+  } else if (argc == 3 && 0 == strcmp("persist", argv[1])
+      && (0 == strcmp("on", argv[2]) || 0 == strcmp("off", argv[2]))) {
+    bool on = 0 == strcmp("on", argv[2]);
+    batch_add(batch, 22, on ? OPTION_PERSIST : 0, OPTION_PERSIST);  // Set option
+    return true;
+
+  } else if (argc == 2 && 0 == strcmp("sync", argv[1])) {
+    uint32_t time = sync_time() + SYNC_LATENCY;
+    batch_add(batch, 23, time & 0xffff, time >> 16);  // Synchronize clock
+    return true;
+
+  } else if (argc >= 4 && 0 == strcmp("at", argv[1])) {
+    // The device's queue only tells times apart within 2^31 ms (see
+    // is_before in queue.c).
+    unsigned long delay = str_to_duration(argv[2]);
+    if (errno != 0 || delay >= 0x80000000UL) {
+      printf("error: delay must be a number of ms, s, m or h (at most 24 days)\n");
+      return false;
+    }
+
+    // at <delay> <command>: the command's requests, queued for <delay> from
+    // now. The clock is synchronized first, so that "now" is the same on
+    // the host and on a device that was never synchronized.
+    char *command_argv[argc - 1];
+    command_argv[0] = argv[0];
+    memcpy(command_argv + 1, argv + 3, (argc - 3) * sizeof(char *));
+    batch_t command;
+    if (!parse_command(argc - 2, command_argv, &command)) return false;
+
+    uint32_t now = sync_time();
+    uint32_t time = now + delay;
+    batch_add(batch, 23, (now + SYNC_LATENCY) & 0xffff, (now + SYNC_LATENCY) >> 16);  // Synchronize clock
+    batch_add(batch, 24, time & 0xffff, time >> 16);  // At time
+    if (!batch_append(batch, &command)) {
+      printf("error: command too long\n");
+      return false;
+    }
+    return true;
+
+  } else {
+    print_usage();
+    return false;
+  }
+}
+
+void print_usage()
+{
+  printf("usage: [--device <serial>[,<serial>...] | --all] <command>\n");
+  printf("  list  (serial numbers and bus paths of all devices)\n");
+  printf("  set <r> <g> <b>\n");
+  printf("  fade <r> <g> <b> [<speed>]\n");
+  printf("  fade <r> <g> <b> in <duration>  (e.g. 500, 500ms, 10s, 5m, 2h)\n");
+  printf("  status (on|off|blink)\n");
+  printf("  blink <duty-ms> [<period-ms>] [<r> <g> <b>]\n");
+  printf("  blink off\n");
+  printf("  dither (on|off)  (finer dim levels by varying the output per ms)\n");
+  printf("  persist (on|off)  (keep the settings in EEPROM, restored at power-on)\n");
+  printf("  off\n");
+  printf("  effect (breathe|rainbow|strobe|alternate) <period-ms> [<r> <g> <b> [<r2> <g2> <b2>]]\n");
+  printf("  effect off\n");
+  printf("  pixel <index> <r> <g> <b>\n");
+  printf("  fill <first> <count> <r> <g> <b>\n");
+  printf("  frame [--hsv] [--correct] [<first>]  (reads 8 bit \"<r> <g> <b>\" or\n");
+  printf("      \"<h> <s> <v>\" values per pixel from stdin; --correct applies the\n");
+  printf("      color settings in $USB_LED_COLOR or ~/.config/usb-led/color)\n");
+  printf("  stream [--binary] [--fps <n>]  (reads \"<r> <g> <b>\" lines or\n");
+  printf("      6 byte little-endian frames from stdin; --fps 0 for unpaced)\n");
+  printf("  sequence [<lead-ms>]  (reads \"<ms> <command>\" lines from stdin and\n");
+  printf("      queues them on the device, to be played <lead-ms> (50) from now)\n");
+  printf("  bench [<count>]  (compares synchronous and pipelined transfer rates)\n");
+  printf("  state  (the device's current colors, fade, blink and options)\n");
+  printf("  stats [<interval>]  (diagnostic counters, every <interval> if given)\n");
+  printf("  sync  (sets the device clock to the host's; repeat now and then)\n");
+  printf("  at <delay> <command>  (runs the command <delay> from now, e.g. 2s;\n");
+  printf("      syncs the clock first, so several devices run it at the same time)\n");
+}
@@ -0,0 +1,16 @@
+#ifndef _COMMAND_H
+#define _COMMAND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "device.h"
+
+uint16_t str_to_uint16(char *str);
+unsigned long str_to_duration(char *str);
+unsigned long sync_time();
+
+bool parse_command(int argc, char **argv, batch_t *batch);
+void print_usage();
+
+#endif
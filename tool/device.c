@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "device.h"
+
+
+// detach_kernel_driver makes sure no kernel driver claims the device.
+static bool detach_kernel_driver(libusb_device_handle *hDev)
+{
+  if (libusb_kernel_driver_active(hDev,0)) {
+    printf("detaching device from kernel\n");
+    int ret = libusb_detach_kernel_driver(hDev,0);
+    if (ret < 0 )
+    {
+      printf("error: %s\n", libusb_error_name(ret));
+      return false;
+    }
+  }
+  return true;
+}
+
+// device_path formats the bus number and port numbers leading to a device
+// (like Linux sysfs does, e.g. "1-4.2"). Stays the same as long as the
+// device remains plugged into the same port.
+static void device_path(libusb_device *dev, char *path, size_t size)
+{
+  uint8_t ports[7];
+  int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+  int len = snprintf(path, size, "%d", libusb_get_bus_number(dev));
+  for (int i = 0; i < n && len < (int)size; i++) {
+    len += snprintf(path + len, size - len, i == 0 ? "-%d" : ".%d", ports[i]);
+  }
+}
+
+// device_serial opens dev if it is a usb-led and reads its serial number.
+// Returns NULL if it isn't one (or has no serial number, like old
+// firmware), or can't be opened.
+static libusb_device_handle* device_serial(libusb_device *dev, char *serial, size_t size)
+{
+  struct libusb_device_descriptor desc;
+  if (libusb_get_device_descriptor(dev, &desc) < 0
+      || desc.idVendor != VID || desc.idProduct != PID || desc.iSerialNumber == 0) {
+    return NULL;
+  }
+
+  libusb_device_handle *hDev;
+  if (libusb_open(dev, &hDev) < 0) {
+    return NULL;
+  }
+  if (libusb_get_string_descriptor_ascii(hDev, desc.iSerialNumber,
+        (unsigned char *)serial, size) < 0) {
+    libusb_close(hDev);
+    return NULL;
+  }
+  return hDev;
+}
+
+// find_device opens the usb-led with the given serial number.
+//
+// Reading serial numbers takes a control transfer per device, so the
+// device at the bus path in the registry (see registry.c) is tried first.
+// If that isn't it, all usb-leds are asked, and the registry updated.
+static libusb_device_handle* find_device(const char *serial)
+{
+  libusb_device **list;
+  ssize_t count = libusb_get_device_list(NULL, &list);
+  if (count < 0) {
+    printf("error: %s\n", libusb_error_name(count));
+    return NULL;
+  }
+
+  libusb_device_handle *hDev = NULL;
+  char path[REGISTRY_PATH_MAX + 1], cached[REGISTRY_PATH_MAX + 1];
+  char found[REGISTRY_SERIAL_MAX + 1];
+
+  if (registry_lookup(serial, cached, sizeof(cached))) {
+    for (ssize_t i = 0; i < count && hDev == NULL; i++) {
+      device_path(list[i], path, sizeof(path));
+      if (0 == strcmp(path, cached)) {
+        hDev = device_serial(list[i], found, sizeof(found));
+        if (hDev != NULL && 0 != strcmp(found, serial)) {
+          libusb_close(hDev);
+          hDev = NULL;
+        }
+        break;
+      }
+    }
+  }
+
+  for (ssize_t i = 0; i < count && hDev == NULL; i++) {
+    hDev = device_serial(list[i], found, sizeof(found));
+    if (hDev != NULL && 0 != strcmp(found, serial)) {
+      libusb_close(hDev);
+      hDev = NULL;
+    } else if (hDev != NULL) {
+      device_path(list[i], path, sizeof(path));
+      registry_store(serial, path);
+    }
+  }
+
+  libusb_free_device_list(list, 1);
+  return hDev;
+}
+
+// open_device opens the usb-led with the given serial number, or the first
+// one found if serial is NULL. libusb_init must have been called before.
+libusb_device_handle* open_device(const char *serial) {
+  libusb_device_handle *hDev;
+  if (serial == NULL) {
+    hDev = libusb_open_device_with_vid_pid(NULL, VID, PID);
+  } else {
+    hDev = find_device(serial);
+  }
+
+  if (hDev == NULL) {
+    if (serial == NULL) {
+      printf("error: device not found\n");
+    } else {
+      printf("error: device %s not found\n", serial);
+    }
+    return NULL;
+  }
+
+  if (!detach_kernel_driver(hDev)) {
+    return NULL;
+  }
+
+  return hDev;
+}
+
+// in_list checks whether serial is one of the comma-separated serial
+// numbers in list.
+static bool in_list(const char *list, const char *serial)
+{
+  size_t length = strlen(serial);
+  for (const char *p = list; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') p++;
+    if (0 == strncmp(p, serial, length) && (p[length] == ',' || p[length] == '\0')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// open_devices opens every usb-led (if serials is NULL) or those whose
+// serial numbers are in the comma-separated list serials, up to max of
+// them, with a single scan of the bus. Their serial numbers go to
+// found[]. Prints an error for each listed serial number not found, and
+// sets all_found accordingly. Returns the number of devices opened.
+int open_devices(const char *serials, libusb_device_handle **handles,
+  device_serial_t *found, int max, bool *all_found)
+{
+  *all_found = true;
+
+  libusb_device **list;
+  ssize_t count = libusb_get_device_list(NULL, &list);
+  if (count < 0) {
+    printf("error: %s\n", libusb_error_name(count));
+    return 0;
+  }
+
+  int n = 0;
+  char path[REGISTRY_PATH_MAX + 1];
+  for (ssize_t i = 0; i < count && n < max; i++) {
+    libusb_device_handle *hDev = device_serial(list[i], found[n], sizeof(found[n]));
+    if (hDev == NULL) continue;
+    if ((serials != NULL && !in_list(serials, found[n])) || !detach_kernel_driver(hDev)) {
+      libusb_close(hDev);
+      continue;
+    }
+
+    device_path(list[i], path, sizeof(path));
+    registry_store(found[n], path);
+    handles[n++] = hDev;
+  }
+  libusb_free_device_list(list, 1);
+
+  // Report the listed serial numbers we didn't find
+  for (const char *p = serials; p != NULL && *p != '\0'; ) {
+    size_t length = strcspn(p, ",");
+    bool ok = false;
+    for (int i = 0; i < n && !ok; i++) {
+      ok = strlen(found[i]) == length && 0 == strncmp(found[i], p, length);
+    }
+    if (!ok && length > 0) {
+      *all_found = false;
+      printf("error: device %.*s not found\n", (int)length, p);
+    }
+    p += length;
+    if (*p == ',') p++;
+  }
+
+  return n;
+}
+
+// list_devices prints the serial number and bus path of every usb-led,
+// and records them in the registry. Returns the number of devices.
+int list_devices() {
+  libusb_device **list;
+  ssize_t count = libusb_get_device_list(NULL, &list);
+  if (count < 0) {
+    printf("error: %s\n", libusb_error_name(count));
+    return 0;
+  }
+
+  int found = 0;
+  char serial[REGISTRY_SERIAL_MAX + 1], path[REGISTRY_PATH_MAX + 1];
+  for (ssize_t i = 0; i < count; i++) {
+    libusb_device_handle *hDev = device_serial(list[i], serial, sizeof(serial));
+    if (hDev == NULL) continue;
+    libusb_close(hDev);
+
+    device_path(list[i], path, sizeof(path));
+    registry_store(serial, path);
+    printf("%s %s\n", serial, path);
+    found++;
+  }
+
+  libusb_free_device_list(list, 1);
+  return found;
+}
+
+
+bool perform_control_transfer(libusb_device_handle *hDev,
+  uint8_t request, uint16_t value, uint16_t index)
+{
+  int ret = libusb_control_transfer(
+      hDev,
+      LIBUSB_ENDPOINT_OUT
+        | LIBUSB_REQUEST_TYPE_VENDOR
+        | LIBUSB_RECIPIENT_DEVICE,
+      request,
+      value,
+      index,
+      NULL,  // data
+      0,  // data length
+      250);  // timeout in ms
+
+  if (ret < 0) {
+    printf("error: %s\n", libusb_error_name(ret));
+    return false;
+  }
+
+  return true;
+}
+
+
+// perform_control_in_transfer reads up to <length> bytes from a vendor
+// request. Returns the number of bytes read, or -1 on error.
+int perform_control_in_transfer(libusb_device_handle *hDev,
+  uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length)
+{
+  int ret = libusb_control_transfer(
+      hDev,
+      LIBUSB_ENDPOINT_IN
+        | LIBUSB_REQUEST_TYPE_VENDOR
+        | LIBUSB_RECIPIENT_DEVICE,
+      request,
+      value,
+      index,
+      data,
+      length,
+      250);  // timeout in ms
+
+  if (ret < 0) {
+    printf("error: %s\n", libusb_error_name(ret));
+    return -1;
+  }
+
+  return ret;
+}
+
+
+void batch_init(batch_t *batch)
+{
+  batch->data[0] = BATCH_VERSION;
+  batch->length = 1;
+}
+
+// batch_arg_length returns the number of argument bytes that follow a
+// request in a batch. Must match the firmware.
+int batch_arg_length(uint8_t request)
+{
+  switch (request) {
+    case 0:
+    case 1:
+    case 13:
+      return 0;
+    case 10:
+    case 12:
+    case 15:
+    case 20:
+    case 21:
+    case 22:
+    case 23:
+    case 24:
+      return 4;  // value, index
+    default:
+      return 2;  // value
+  }
+}
+
+// batch_add appends a request to a batch.
+void batch_add(batch_t *batch, uint8_t request, uint16_t value, uint16_t index)
+{
+  int arg_length = batch_arg_length(request);
+  uint8_t *p = batch->data + batch->length;
+  *p++ = request;
+  if (arg_length >= 2) {
+    *p++ = value & 0xff;
+    *p++ = value >> 8;
+  }
+  if (arg_length >= 4) {
+    *p++ = index & 0xff;
+    *p++ = index >> 8;
+  }
+  batch->length = p - batch->data;
+}
+
+// batch_append appends all requests of another batch.
+// Returns false (and leaves batch unchanged) if they don't fit.
+bool batch_append(batch_t *batch, const batch_t *other)
+{
+  uint16_t length = other->length - 1;  // without version
+  if (batch->length + length > BATCH_MAX_LENGTH) {
+    return false;
+  }
+  memcpy(batch->data + batch->length, other->data + 1, length);
+  batch->length += length;
+  return true;
+}
+
+bool perform_batch_transfer(libusb_device_handle *hDev, batch_t *batch)
+{
+  int ret = libusb_control_transfer(
+      hDev,
+      LIBUSB_ENDPOINT_OUT
+        | LIBUSB_REQUEST_TYPE_VENDOR
+        | LIBUSB_RECIPIENT_DEVICE,
+      BATCH_REQUEST,
+      0,  // value
+      0,  // index
+      batch->data,
+      batch->length,
+      250);  // timeout in ms
+
+  if (ret < 0) {
+    printf("error: %s\n", libusb_error_name(ret));
+    return false;
+  }
+
+  return true;
+}
+
+// perform_stream_transfer sends one frame to the streaming endpoint.
+// The device latches it on its next millisecond tick.
+bool perform_stream_transfer(libusb_device_handle *hDev,
+  uint16_t r, uint16_t g, uint16_t b)
+{
+  uint8_t frame[8] = {
+    r & 0xff, r >> 8,
+    g & 0xff, g >> 8,
+    b & 0xff, b >> 8,
+    0, 0,  // reserved
+  };
+  int transferred;
+
+  int ret = libusb_interrupt_transfer(
+      hDev,
+      LIBUSB_ENDPOINT_OUT | STREAM_ENDPOINT,
+      frame,
+      sizeof(frame),
+      &transferred,
+      250);  // timeout in ms
+
+  if (ret < 0) {
+    printf("error: %s\n", libusb_error_name(ret));
+    return false;
+  }
+
+  return true;
+}
+
+// perform_frame_transfer uploads 8 bit red/green/blue values for <count>
+// pixels to the device's frame buffer, beginning at pixel <first>.
+// Shows the frame buffer afterwards if show is true.
+bool perform_frame_transfer(libusb_device_handle *hDev,
+  uint16_t first, const uint8_t *rgb, uint16_t count, bool show)
+{
+  while (count > 0) {
+    uint16_t n = count < FRAME_MAX_PIXELS ? count : FRAME_MAX_PIXELS;
+    count -= n;
+
+    int ret = libusb_control_transfer(
+        hDev,
+        LIBUSB_ENDPOINT_OUT
+          | LIBUSB_REQUEST_TYPE_VENDOR
+          | LIBUSB_RECIPIENT_DEVICE,
+        FRAME_REQUEST,
+        show && count == 0,  // value: show when complete?
+        first,  // index
+        (unsigned char *)rgb,
+        n * 3,
+        250);  // timeout in ms
+
+    if (ret < 0) {
+      printf("error: %s\n", libusb_error_name(ret));
+      return false;
+    }
+
+    first += n;
+    rgb += n * 3;
+  }
+
+  return true;
+}
@@ -0,0 +1,71 @@
+#ifndef _DEVICE_H
+#define _DEVICE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libusb.h>
+
+#include "registry.h"
+
+#define VID 0xF055
+#define PID 0x49D9
+
+// Batches of requests, applied by the device in a single control transfer.
+// Must match the firmware's BATCH_VERSION and BATCH_MAX_LENGTH.
+#define BATCH_REQUEST     11
+#define BATCH_VERSION     1
+#define BATCH_MAX_LENGTH  32
+
+// Must match the firmware's QUEUE_LENGTH (requests queued with "at").
+#define QUEUE_LENGTH      16
+
+// Frame buffer uploads. V-USB limits control transfers to 254 bytes.
+#define FRAME_REQUEST     14
+#define FRAME_MAX_PIXELS  84
+
+// Interrupt-out endpoint for streaming frames.
+#define STREAM_ENDPOINT   0x01
+
+// Diagnostic counters (control-in). Must match the firmware's stats_t.
+#define STATS_REQUEST     25
+#define STATS_LENGTH      16
+
+// Option bits (request 22). Must match the firmware's OPTION_* bits.
+#define OPTION_REQUEST      22
+#define OPTION_DITHER       (1 << 0)
+#define OPTION_PASSTHROUGH  (1 << 1)
+#define OPTION_PERSIST      (1 << 2)
+
+
+typedef struct {
+  uint8_t data[BATCH_MAX_LENGTH];
+  uint16_t length;
+} batch_t;
+
+typedef char device_serial_t[REGISTRY_SERIAL_MAX + 1];
+
+
+libusb_device_handle* open_device(const char *serial);
+int list_devices();
+int open_devices(const char *serials, libusb_device_handle **handles,
+  device_serial_t *found, int max, bool *all_found);
+
+bool perform_control_transfer(libusb_device_handle *hDev,
+  uint8_t request, uint16_t value, uint16_t index);
+int perform_control_in_transfer(libusb_device_handle *hDev,
+  uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length);
+
+void batch_init(batch_t *batch);
+int batch_arg_length(uint8_t request);
+void batch_add(batch_t *batch, uint8_t request, uint16_t value, uint16_t index);
+bool batch_append(batch_t *batch, const batch_t *other);
+bool perform_batch_transfer(libusb_device_handle *hDev, batch_t *batch);
+
+bool perform_frame_transfer(libusb_device_handle *hDev,
+  uint16_t first, const uint8_t *rgb, uint16_t count, bool show);
+
+bool perform_stream_transfer(libusb_device_handle *hDev,
+  uint16_t r, uint16_t g, uint16_t b);
+
+#endif
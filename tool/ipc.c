@@ -0,0 +1,132 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ipc.h"
+
+
+/* runtime_dir returns the directory for the daemon's sockets:
+ * $XDG_RUNTIME_DIR, or else /tmp/usb-led-<uid>, which is created (mode
+ * 0700) if create is true.
+ *
+ * Anyone may create files in /tmp, so the latter is only used if it is
+ * a directory of our own that no one else can access. Otherwise, others
+ * could drive the device through our daemon, or pose as it. Returns NULL
+ * (and prints an error) if it isn't, or NULL if it doesn't exist.
+ */
+static const char* runtime_dir(bool create)
+{
+  static char dir[32];
+
+  const char *env = getenv("XDG_RUNTIME_DIR");
+  if (env != NULL) {
+    return env;
+  }
+
+  snprintf(dir, sizeof(dir), "/tmp/usb-led-%u", (unsigned)getuid());
+  if (create && mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    printf("error: %s: %s\n", dir, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if (lstat(dir, &st) < 0) {
+    if (errno != ENOENT) {
+      printf("error: %s: %s\n", dir, strerror(errno));
+    }
+    return NULL;
+  }
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+    printf("error: %s is not a private directory of ours, not using it\n", dir);
+    return NULL;
+  }
+  return dir;
+}
+
+/* The daemon's socket is $USB_LED_SOCKET, or usb-led.sock in the
+ * runtime directory (see runtime_dir). Create is true for the daemon,
+ * to create the directory if needed.
+ *
+ * A daemon for the device with a given serial number (ledd --device)
+ * listens on usb-led-<serial>.sock there instead.
+ *
+ * Returns NULL if there is no safe place for the socket.
+ */
+const char* socket_path(const char *serial, bool create)
+{
+  static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+  const char *env = getenv("USB_LED_SOCKET");
+  if (env != NULL && serial == NULL) {
+    return env;
+  }
+
+  const char *dir = runtime_dir(create);
+  if (dir == NULL) {
+    return NULL;
+  }
+  if (serial != NULL) {
+    snprintf(path, sizeof(path), "%s/usb-led-%s.sock", dir, serial);
+  } else {
+    snprintf(path, sizeof(path), "%s/usb-led.sock", dir);
+  }
+  return path;
+}
+
+/* Sends a command line (argv[1] being the command) to the daemon for the
+ * device with the given serial number (NULL: the default one) and prints
+ * its reply.
+ *
+ * The protocol is line based: the client sends the command's words
+ * separated by spaces; the daemon replies with the command's output,
+ * followed by a line "exit <status>".
+ *
+ * Returns the command's exit status, or -1 if no daemon is listening.
+ */
+int daemon_request(const char *serial, int argc, char **argv)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  const char *path = socket_path(serial, false);
+  if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  FILE *conn = fdopen(fd, "r+");
+  if (conn == NULL) {
+    close(fd);
+    return -1;
+  }
+  for (int i = 1; i < argc; i++) {
+    fprintf(conn, i == 1 ? "%s" : " %s", argv[i]);
+  }
+  fprintf(conn, "\n");
+  fflush(conn);
+
+  int status = 1;
+  char line[256];
+  while (fgets(line, sizeof(line), conn) != NULL) {
+    if (1 == sscanf(line, "exit %d", &status)) {
+      break;
+    }
+    fputs(line, stdout);
+  }
+
+  fclose(conn);
+  return status;
+}
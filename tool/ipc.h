@@ -0,0 +1,9 @@
+#ifndef _IPC_H
+#define _IPC_H
+
+#include <stdbool.h>
+
+const char* socket_path(const char *serial, bool create);
+int daemon_request(const char *serial, int argc, char **argv);
+
+#endif
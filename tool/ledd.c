@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <libusb.h>
+
+#include "command.h"
+#include "device.h"
+#include "ipc.h"
+#include "mirror.h"
+
+#define MAX_ARGS 16
+
+
+/* usb-led daemon.
+ *
+ * Keeps the device open and executes commands received over a Unix
+ * domain socket (see daemon_request for the protocol). This saves
+ * clients the libusb initialization and bus enumeration on every call.
+ *
+ * Clients are served one at a time.
+ *
+ * Requests that would change nothing on the device are not sent (see
+ * mirror.c). Clients that change the device some other way send the
+ * line "forget" first, so that its state is read again.
+ *
+ * With --device <serial>, it serves only that device, on its own socket
+ * (see socket_path). Run one per device to address several.
+ */
+
+
+static libusb_device_handle *hDev = NULL;
+
+// Serial number of the device to serve (NULL: the first one found)
+static const char *device = NULL;
+
+// What we know about the device's state
+static mirror_t mirror;
+
+
+/* Runs a single command line and returns its exit status.
+ * Output goes to stdout, which is redirected to the client meanwhile.
+ */
+static int run_command(char *line)
+{
+  char *argv[MAX_ARGS + 1] = { "ledd" };
+  int argc = 1;
+  for (char *tok = strtok(line, " \t\r\n"); tok != NULL; tok = strtok(NULL, " \t\r\n")) {
+    if (argc == MAX_ARGS) {
+      print_usage();
+      return 1;
+    }
+    argv[argc++] = tok;
+  }
+
+  if (argc == 2 && 0 == strcmp("forget", argv[1])) {
+    mirror.valid = false;
+    return 0;
+  }
+
+  batch_t batch, changes;
+  if (!parse_command(argc, argv, &batch)) return 1;
+
+  for (int attempt = 1; ; attempt++) {
+    if (hDev == NULL) {
+      hDev = open_device(device);
+      if (hDev == NULL) return 1;
+      mirror.valid = false;
+      mirror.unsupported = false;
+    }
+
+    if (!mirror.valid && !mirror.unsupported) {
+      mirror_read(hDev, &mirror);
+    }
+    mirror_filter(&mirror, &batch, &changes);
+    if (changes.length == 1) {
+      return 0;  // nothing to change
+    }
+
+    if (perform_batch_transfer(hDev, &changes)) {
+      return 0;
+    }
+
+    // The device may have been unplugged (and plugged in again). The
+    // mirror was already updated, so it's read again after reopening;
+    // then the command is tried once more.
+    libusb_close(hDev);
+    hDev = NULL;
+    if (attempt == 2) {
+      return 1;
+    }
+  }
+}
+
+static void serve_client(int fd)
+{
+  // Don't let a stalled client block everyone else
+  struct timeval timeout = { .tv_sec = 1 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  FILE *conn = fdopen(fd, "r");
+  if (conn == NULL) {
+    close(fd);
+    return;
+  }
+
+  int saved_stdout = dup(STDOUT_FILENO);
+
+  char line[256];
+  while (fgets(line, sizeof(line), conn) != NULL) {
+    fflush(stdout);
+    dup2(fd, STDOUT_FILENO);
+    int status = run_command(line);
+    printf("exit %d\n", status);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+  }
+
+  close(saved_stdout);
+  fclose(conn);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc == 3 && 0 == strcmp("--device", argv[1])) {
+    device = argv[2];
+  } else if (argc != 1) {
+    fprintf(stderr, "usage: ledd [--device <serial>]\n");
+    return 1;
+  }
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  const char *path = socket_path(device, true);
+  if (path == NULL) {
+    return 1;
+  }
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "error: socket path too long\n");
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  // Clients that hang up early must not kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  libusb_init(NULL);
+
+  int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (srv < 0) {
+    perror("error: socket");
+    return 1;
+  }
+  unlink(path);  // stale socket of a previous instance
+  if (bind(srv, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("error: bind");
+    return 1;
+  }
+  if (listen(srv, 16) < 0) {
+    perror("error: listen");
+    return 1;
+  }
+
+  // Open the device right away, so the first command is fast too.
+  // (If that fails, we'll retry on each command.)
+  hDev = open_device(device);
+  fflush(stdout);
+
+  while (1) {
+    int fd = accept(srv, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      perror("error: accept");
+      return 1;
+    }
+    serve_client(fd);
+  }
+
+  return 0;
+}
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "mirror.h"
+
+
+/* Mirror of a device's state, for skipping requests that would change
+ * nothing (delta suppression).
+ *
+ * The mirror is read from the device (request 26) and then kept up to
+ * date by applying the requests sent to the device to it. Only requests
+ * whose effect is simple to model are, and only while the device doesn't
+ * change its state by itself (no effect running, nothing queued). Any
+ * other request invalidates the mirror, so it is read again next time.
+ *
+ * Fades change the channel values by themselves, so requests depending
+ * on them are only skipped while the channels are settled.
+ */
+
+
+static uint16_t get16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+// mirror_read reads the device's state into mirror. Returns false (and
+// leaves the mirror invalid) on errors.
+bool mirror_read(libusb_device_handle *hDev, mirror_t *mirror)
+{
+  uint8_t data[STATE_LENGTH];
+  mirror->valid = false;
+  int length = perform_control_in_transfer(hDev, STATE_REQUEST, 0, 0, data, sizeof(data));
+  if (length < 0) {
+    return false;
+  } else if (length != STATE_LENGTH) {
+    mirror->unsupported = true;  // old firmware
+    return false;
+  }
+
+  const uint8_t *p = data;
+  mirror->fade_left = get16(p) | ((uint32_t)get16(p + 2) << 16); p += 4;
+  for (int i = 0; i < 3; i++, p += 2) mirror->rgb[i] = get16(p);
+  for (int i = 0; i < 3; i++, p += 2) mirror->target[i] = get16(p);
+  mirror->fade_rate = get16(p); p += 2;
+  mirror->blink_duty = get16(p); p += 2;
+  mirror->blink_period = get16(p); p += 2;
+  for (int i = 0; i < 3; i++, p += 2) mirror->rgb2[i] = get16(p);
+  mirror->status = *p++;
+  mirror->options = *p++;
+  mirror->flags = *p++;
+  mirror->queued = *p++;
+
+  mirror->valid = true;
+  return true;
+}
+
+void mirror_print(const mirror_t *mirror)
+{
+  printf("color: %u %u %u\n", mirror->rgb[0], mirror->rgb[1], mirror->rgb[2]);
+  printf("fade: to %u %u %u, speed %u, %lu ms left\n",
+      mirror->target[0], mirror->target[1], mirror->target[2],
+      mirror->fade_rate, (unsigned long)mirror->fade_left);
+  printf("blink: %u of %u ms%s\n", mirror->blink_duty, mirror->blink_period,
+      (mirror->flags & STATE_BLINKING) ? "" : " (off)");
+  printf("secondary color: %u %u %u\n", mirror->rgb2[0], mirror->rgb2[1], mirror->rgb2[2]);
+  printf("status: %s\n", mirror->status == 0 ? "off" : mirror->status == 1 ? "on" : "blink");
+  printf("options:%s%s%s\n",
+      (mirror->options & OPTION_DITHER) ? " dither" : "",
+      (mirror->options & OPTION_PASSTHROUGH) ? " passthrough" : "",
+      (mirror->options & OPTION_PERSIST) ? " persist" : "");
+  printf("showing: %s%s%s\n",
+      (mirror->flags & STATE_EFFECT) ? "effect" : (mirror->flags & STATE_SHOW_FRAME) ? "frame" : "color",
+      (mirror->flags & STATE_BLINK_DARK) ? " (dark phase)" : "",
+      (mirror->flags & STATE_UNCOMMITTED) ? " (uncommitted changes)" : "");
+  printf("queued: %u\n", mirror->queued);
+}
+
+// settled checks whether the mirrored channel values are the device's:
+// no fade in progress.
+static bool settled(const mirror_t *m)
+{
+  return m->fade_left == 0 && 0 == memcmp(m->rgb, m->target, sizeof(m->rgb));
+}
+
+// apply updates the mirror for a request sent to the device, and returns
+// true if the request would have changed nothing (so it needn't be sent).
+// Invalidates the mirror if it can't tell.
+static bool apply(mirror_t *m, uint8_t request, uint16_t value, uint16_t index)
+{
+  switch (request) {
+
+    // Off
+    case 0:
+      if (!settled(m)) break;
+      if (m->rgb[0] == 0 && m->rgb[1] == 0 && m->rgb[2] == 0 && m->status == 0
+          && !(m->flags & (STATE_SHOW_FRAME | STATE_UNCOMMITTED | STATE_STATUS_LED))) {
+        return true;
+      }
+      memset(m->rgb, 0, sizeof(m->rgb));
+      memset(m->target, 0, sizeof(m->target));
+      m->status = 0;
+      m->flags &= ~(STATE_SHOW_FRAME | STATE_UNCOMMITTED | STATE_STATUS_LED);
+      return false;
+
+    // Commit
+    case 1:
+      if (!settled(m)) break;
+      if (!(m->flags & (STATE_SHOW_FRAME | STATE_UNCOMMITTED))
+          && (m->status == 2 || (m->status == 1) == !!(m->flags & STATE_STATUS_LED))) {
+        return true;
+      }
+      m->flags &= ~(STATE_SHOW_FRAME | STATE_UNCOMMITTED | STATE_STATUS_LED);
+      m->flags |= m->status == 1 ? STATE_STATUS_LED : 0;
+      return false;
+
+    // Status LED (the LED's blink phase is unknown when it stops blinking)
+    case 2:
+      if (m->status == (value & 0xff)) {
+        return true;
+      } else if (m->status == 2) {
+        break;
+      }
+      m->status = value & 0xff;
+      return false;
+
+    // Set channel values
+    case 3:
+    case 4:
+    case 5:
+      if (!settled(m)) break;
+      if (m->rgb[request - 3] == value) {
+        return true;
+      }
+      m->rgb[request - 3] = m->target[request - 3] = value;
+      m->flags |= STATE_UNCOMMITTED;
+      return false;
+
+    // Fade channel values
+    case 6:
+    case 7:
+    case 8:
+      if (m->fade_left == 0 && m->target[request - 6] == value) {
+        return true;
+      }
+      if (!settled(m)) break;
+      m->target[request - 6] = value;
+      return false;
+
+    // Fade speed (0: stop fading)
+    case 9:
+      if (value > 0 && m->fade_rate == value) {
+        return true;
+      } else if (value == 0 && settled(m)) {
+        return true;
+      } else if (value == 0) {
+        break;
+      }
+      m->fade_rate = value;
+      return false;
+
+    // Secondary color
+    case 16:
+    case 17:
+    case 18:
+      if (m->rgb2[request - 16] == value) {
+        return true;
+      }
+      m->rgb2[request - 16] = value;
+      return false;
+
+    // Options
+    case 22:
+      if ((m->options & index) == (value & index)) {
+        return true;
+      }
+      m->options = (m->options & ~index) | (value & index);
+      return false;
+  }
+
+  m->valid = false;
+  return false;
+}
+
+/* Copies the requests of batch that would change something to out, and
+ * updates the mirror for them. If the mirror isn't valid, all of them
+ * are copied. An empty batch (length 1) needn't be sent at all.
+ */
+void mirror_filter(mirror_t *mirror, const batch_t *batch, batch_t *out)
+{
+  batch_init(out);
+  if (mirror->valid && ((mirror->flags & STATE_EFFECT) || mirror->queued > 0)) {
+    mirror->valid = false;  // changes by itself
+  }
+
+  for (uint16_t pos = 1; pos < batch->length; ) {
+    const uint8_t *p = batch->data + pos;
+    int arg_length = batch_arg_length(p[0]);
+    uint16_t value = arg_length >= 2 ? get16(p + 1) : 0;
+    uint16_t index = arg_length >= 4 ? get16(p + 3) : 0;
+
+    if (!mirror->valid || !apply(mirror, p[0], value, index)) {
+      memcpy(out->data + out->length, p, 1 + arg_length);
+      out->length += 1 + arg_length;
+    }
+    pos += 1 + arg_length;
+  }
+}
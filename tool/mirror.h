@@ -0,0 +1,38 @@
+#ifndef _MIRROR_H
+#define _MIRROR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libusb.h>
+
+#include "device.h"
+
+// State readback (control-in). Must match the firmware's state_reply_t.
+#define STATE_REQUEST       26
+#define STATE_LENGTH        32
+
+#define STATE_SHOW_FRAME    (1 << 0)
+#define STATE_BLINK_DARK    (1 << 1)
+#define STATE_BLINKING      (1 << 2)
+#define STATE_EFFECT        (1 << 3)
+#define STATE_UNCOMMITTED   (1 << 4)
+#define STATE_STATUS_LED    (1 << 5)
+
+
+// What the host knows about a device's state.
+typedef struct {
+  bool valid;  // false: unknown, read it again
+  bool unsupported;  // the firmware has no state readback
+  uint32_t fade_left;
+  uint16_t rgb[3], target[3], fade_rate;
+  uint16_t blink_duty, blink_period;
+  uint16_t rgb2[3];
+  uint8_t status, options, flags, queued;
+} mirror_t;
+
+bool mirror_read(libusb_device_handle *hDev, mirror_t *mirror);
+void mirror_print(const mirror_t *mirror);
+void mirror_filter(mirror_t *mirror, const batch_t *batch, batch_t *out);
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "registry.h"
+
+
+/* Device registry: remembers where on the bus each device (by serial
+ * number) was last seen, one "<serial> <bus path>" line per device. It is
+ * only a cache; open_device falls back to a full scan if an entry is
+ * missing or stale, and updates it.
+ */
+
+
+/* Returns the registry file: $USB_LED_REGISTRY, or usb-led/devices in
+ * $XDG_CACHE_HOME (or ~/.cache if that isn't set).
+ */
+const char* registry_path()
+{
+  static char path[512];
+  const char *env = getenv("USB_LED_REGISTRY");
+  if (env != NULL && *env != '\0') {
+    return env;
+  }
+  const char *cache = getenv("XDG_CACHE_HOME");
+  if (cache != NULL && *cache != '\0') {
+    snprintf(path, sizeof(path), "%s/usb-led/devices", cache);
+  } else {
+    const char *home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/.cache/usb-led/devices", home ? home : ".");
+  }
+  return path;
+}
+
+/* Looks up the bus path where the device with the given serial number was
+ * last seen. Returns false if it isn't known.
+ */
+bool registry_lookup(const char *serial, char *bus_path, size_t size)
+{
+  FILE *f = fopen(registry_path(), "r");
+  if (f == NULL) {
+    return false;
+  }
+
+  bool found = false;
+  char line[128], s[REGISTRY_SERIAL_MAX + 1], p[REGISTRY_PATH_MAX + 1];
+  while (!found && fgets(line, sizeof(line), f) != NULL) {
+    if (2 == sscanf(line, "%32s %32s", s, p) && 0 == strcmp(s, serial)
+        && strlen(p) < size) {
+      strcpy(bus_path, p);
+      found = true;
+    }
+  }
+
+  fclose(f);
+  return found;
+}
+
+/* Records that the device with the given serial number is at bus_path.
+ * Drops other entries for that serial number or bus path, as they are
+ * stale now. Failing to write the registry is not an error (it's just
+ * slower next time).
+ */
+void registry_store(const char *serial, const char *bus_path)
+{
+  const char *path = registry_path();
+  char tmp_path[520];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  // Create the directory if needed (only the last two levels)
+  char dir[512];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char *slash = strrchr(dir, '/');
+  if (slash != NULL) {
+    *slash = '\0';
+    char *parent = strrchr(dir, '/');
+    if (parent != NULL) {
+      *parent = '\0';
+      mkdir(dir, 0755);
+      *parent = '/';
+    }
+    mkdir(dir, 0755);
+  }
+
+  FILE *out = fopen(tmp_path, "w");
+  if (out == NULL) {
+    return;
+  }
+
+  FILE *in = fopen(path, "r");
+  if (in != NULL) {
+    char line[128], s[REGISTRY_SERIAL_MAX + 1], p[REGISTRY_PATH_MAX + 1];
+    while (fgets(line, sizeof(line), in) != NULL) {
+      if (2 == sscanf(line, "%32s %32s", s, p)
+          && 0 != strcmp(s, serial) && 0 != strcmp(p, bus_path)) {
+        fprintf(out, "%s %s\n", s, p);
+      }
+    }
+    fclose(in);
+  }
+  fprintf(out, "%s %s\n", serial, bus_path);
+
+  // Replace the registry atomically, so concurrent tools never see half of it
+  if (fclose(out) != 0 || rename(tmp_path, path) != 0) {
+    remove(tmp_path);
+  }
+}
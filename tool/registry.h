@@ -0,0 +1,15 @@
+#ifndef _REGISTRY_H
+#define _REGISTRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Longest serial number and bus path we handle (see device_path).
+#define REGISTRY_SERIAL_MAX  32
+#define REGISTRY_PATH_MAX    32
+
+const char* registry_path();
+bool registry_lookup(const char *serial, char *bus_path, size_t size);
+void registry_store(const char *serial, const char *bus_path);
+
+#endif
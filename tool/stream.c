@@ -0,0 +1,246 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "device.h"
+#include "stream.h"
+
+
+/* Streams frames from stdin to the device, paced to a target frame rate.
+ *
+ * Frames are either "<r> <g> <b>" lines or (binary) 6 bytes each: the
+ * red/green/blue values as 16 bit little-endian numbers.
+ *
+ * Frames that arrive faster than they can be sent are dropped: only the
+ * latest one is sent at each frame time.
+ */
+
+
+typedef struct {
+  bool binary;
+  bool eof;
+  char buf[4096];
+  size_t length;
+} reader_t;
+
+typedef struct {
+  unsigned long sent, dropped;
+  double latency_sum, latency_max;  // seconds from reading to sending
+} stats_t;
+
+
+static void timespec_add_ns(struct timespec *t, long ns)
+{
+  t->tv_nsec += ns;
+  while (t->tv_nsec >= 1000000000L) {
+    t->tv_nsec -= 1000000000L;
+    t->tv_sec++;
+  }
+}
+
+static double seconds_between(struct timespec *a, struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* Reads what's available on stdin without blocking.
+ * Returns false on read errors.
+ *
+ * stdin is polled before each read rather than made non-blocking: the
+ * O_NONBLOCK flag would be shared with the shell and the other processes
+ * in the pipeline, and outlive us if we're killed.
+ */
+static bool reader_fill(reader_t *reader)
+{
+  while (!reader->eof && reader->length < sizeof(reader->buf)) {
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    int ready = poll(&pfd, 1, 0);
+    if (ready == 0) {
+      break;
+    } else if (ready < 0) {
+      if (errno == EINTR) continue;
+      printf("error: %s\n", strerror(errno));
+      return false;
+    }
+
+    ssize_t n = read(STDIN_FILENO, reader->buf + reader->length,
+        sizeof(reader->buf) - reader->length);
+    if (n > 0) {
+      reader->length += n;
+    } else if (n == 0) {
+      reader->eof = true;
+    } else if (errno != EINTR) {
+      printf("error: %s\n", strerror(errno));
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Takes the next complete frame out of the buffer.
+ * Returns 1 if there was one, 0 if not, -1 if it's malformed.
+ */
+static int reader_next(reader_t *reader, uint16_t rgb[3])
+{
+  size_t used;
+
+  if (reader->binary) {
+    if (reader->length < 6) return 0;
+    const uint8_t *p = (const uint8_t *)reader->buf;
+    for (int i = 0; i < 3; i++) {
+      rgb[i] = p[2*i] | (p[2*i + 1] << 8);
+    }
+    used = 6;
+
+  } else {
+    char *end = memchr(reader->buf, '\n', reader->length);
+    if (end == NULL) {
+      if (!reader->eof || reader->length == 0) return 0;
+      end = reader->buf + reader->length;  // last line without newline
+      if (reader->length == sizeof(reader->buf)) return -1;
+    }
+    used = end - reader->buf + (end < reader->buf + reader->length);
+
+    char line[64];
+    size_t line_length = end - reader->buf;
+    if (line_length >= sizeof(line)) return -1;
+    memcpy(line, reader->buf, line_length);
+    line[line_length] = '\0';
+
+    char *fields[3];
+    int n = 0;
+    for (char *tok = strtok(line, " \t\r"); tok != NULL && n < 4; tok = strtok(NULL, " \t\r")) {
+      if (n < 3) fields[n] = tok;
+      n++;
+    }
+
+    if (n == 0) {
+      // Skip empty line
+      memmove(reader->buf, reader->buf + used, reader->length - used);
+      reader->length -= used;
+      return reader_next(reader, rgb);
+    }
+
+    int e = 0;
+    if (n == 3) {
+      for (int i = 0; i < 3; i++) {
+        rgb[i] = str_to_uint16(fields[i]); e |= errno;
+      }
+    }
+    if (n != 3 || e != 0) return -1;
+  }
+
+  memmove(reader->buf, reader->buf + used, reader->length - used);
+  reader->length -= used;
+  return 1;
+}
+
+/* Reads all frames available on stdin, keeping only the latest.
+ * Returns 1 if there was one, 0 if not, -1 on errors.
+ */
+static int reader_latest(reader_t *reader, uint16_t rgb[3], stats_t *stats)
+{
+  int found = 0;
+
+  do {
+    if (!reader_fill(reader)) return -1;
+    int ret;
+    while ((ret = reader_next(reader, rgb)) == 1) {
+      if (found) stats->dropped++;
+      found = 1;
+    }
+    if (ret < 0) {
+      printf("error: frames must be three numbers in range 0-65535\n");
+      return -1;
+    }
+  } while (reader->length == sizeof(reader->buf));  // buffer was full
+
+  return found;
+}
+
+int stream(libusb_device_handle *hDev, bool binary, unsigned fps)
+{
+  int ret = libusb_claim_interface(hDev, 0);
+  if (ret < 0) {
+    printf("error: %s\n", libusb_error_name(ret));
+    return 1;
+  }
+
+  static reader_t reader;
+  reader.binary = binary;
+  stats_t stats = { 0 };
+  long interval = fps > 0 ? 1000000000L / fps : 0;  // in ns
+
+  struct timespec start, next, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  next = start;
+
+  int status = 0;
+  uint16_t rgb[3];
+  while (1) {
+
+    // Wait for a frame
+    int found = reader_latest(&reader, rgb, &stats);
+    if (found < 0) {
+      status = 1;
+      break;
+    } else if (!found) {
+      if (reader.eof) break;
+      struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    struct timespec read_time;
+    clock_gettime(CLOCK_MONOTONIC, &read_time);
+
+    // Wait for its frame time; a newer frame that arrived meanwhile wins
+    if (interval > 0) {
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+      uint16_t newer[3];
+      found = reader_latest(&reader, newer, &stats);
+      if (found < 0) {
+        status = 1;
+        break;
+      } else if (found) {
+        stats.dropped++;
+        memcpy(rgb, newer, sizeof(rgb));
+        clock_gettime(CLOCK_MONOTONIC, &read_time);
+      }
+    }
+
+    if (!perform_stream_transfer(hDev, rgb[0], rgb[1], rgb[2])) {
+      status = 1;
+      break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double latency = seconds_between(&read_time, &now);
+    stats.sent++;
+    stats.latency_sum += latency;
+    if (latency > stats.latency_max) stats.latency_max = latency;
+
+    // Schedule the next frame. If we've fallen behind, don't try to
+    // catch up: that would only send stale frames in a burst.
+    timespec_add_ns(&next, interval);
+    if (seconds_between(&next, &now) > 0) {
+      next = now;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = seconds_between(&start, &now);
+  printf("%lu frames sent, %lu dropped, %.1f fps",
+      stats.sent, stats.dropped, elapsed > 0 ? stats.sent / elapsed : 0.0);
+  if (stats.sent > 0) {
+    printf(", latency %.2f ms average, %.2f ms max",
+        1000 * stats.latency_sum / stats.sent, 1000 * stats.latency_max);
+  }
+  printf("\n");
+
+  return status;
+}
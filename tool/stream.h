@@ -0,0 +1,13 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <stdbool.h>
+
+#include <libusb.h>
+
+// Default target frame rate. The streaming endpoint is polled every 10 ms.
+#define STREAM_DEFAULT_FPS 100
+
+int stream(libusb_device_handle *hDev, bool binary, unsigned fps);
+
+#endif
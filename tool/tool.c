@@ -3,197 +3,492 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <libusb.h>
 
-#define VID 0xF055
-#define PID 0x49D9
+#include "color.h"
+#include "command.h"
+#include "device.h"
+#include "ipc.h"
+#include "mirror.h"
+#include "stream.h"
+#include "transfer.h"
 
+// Maximum number of words per line of a sequence.
+#define MAX_SEQUENCE_ARGS 16
 
-uint16_t str_to_uint16(char *str) {
-  errno = 0;
-  char *endptr;
-  long val = strtol(str, &endptr, 0);
-  if (errno != 0) {
-    return 0;
-  } else if (*endptr != '\0') {
-    errno = EINVAL;
-    return 0;
-  } else if (val < 0 || val > 65535) {
-    errno = EINVAL;
-    return 0;
-  }
-  return val;
-}
+// Number of transfers kept in flight by the pipelined benchmark.
+#define BENCH_DEPTH 8
 
+// Maximum number of devices addressed at once (see broadcast).
+#define MAX_GROUP 127
 
-libusb_device_handle* open_device() {
-  libusb_init(NULL);
-  libusb_device_handle *hDev = libusb_open_device_with_vid_pid(NULL, VID, PID);
 
-  if (hDev == NULL) {
-    printf("error: device not found\n");
-    return NULL;
+/* Uploads 8 bit "<r> <g> <b>" values per pixel from stdin to the
+ * frame buffer, beginning at pixel <first>, and shows it.
+ *
+ * With hsv, reads "<h> <s> <v>" values instead (hue in degrees, 0-359).
+ * With correct, the frame goes through the color pipeline (see color.c)
+ * here, and the device passes it through unchanged.
+ */
+int frame(libusb_device_handle *hDev, uint16_t first, bool hsv, bool correct)
+{
+  uint8_t *rgb = NULL;
+  size_t length = 0, size = 0;
+  unsigned hue = 0;
+
+  unsigned value;
+  int ret;
+  while ((ret = scanf("%u", &value)) == 1) {
+    bool is_hue = hsv && length % 3 == 0;
+    if (value > (is_hue ? 359 : 255)) {
+      printf("error: values must be numbers in range 0-255 (hue: 0-359)\n");
+      free(rgb);
+      return 1;
+    }
+    if (length == size) {
+      size = size ? size * 2 : 3 * FRAME_MAX_PIXELS;
+      uint8_t *bigger = realloc(rgb, size);
+      if (bigger == NULL) {
+        printf("error: out of memory\n");
+        free(rgb);
+        return 1;
+      }
+      rgb = bigger;
+    }
+    if (is_hue) {
+      hue = value;
+      rgb[length++] = 0;  // set below
+    } else {
+      rgb[length++] = value;
+    }
+
+    // Complete HSV pixel: convert to RGB
+    if (hsv && length % 3 == 0) {
+      uint8_t *p = rgb + length - 3;
+      float color[3];
+      color_hsv_to_rgb(hue, p[1] / 255.0f, p[2] / 255.0f, color);
+      for (int i = 0; i < 3; i++) {
+        p[i] = (uint8_t)(color[i] * 255 + 0.5f);
+      }
+    }
+  }
+  if (ret != EOF || length % 3 != 0 || length / 3 > 65535) {
+    printf("error: frames must be sequences of \"<r> <g> <b>\" values\n");
+    free(rgb);
+    return 1;
   }
 
-  if (libusb_kernel_driver_active(hDev,0)) {
-    printf("detaching device from kernel\n");
-    int ret = libusb_detach_kernel_driver(hDev,0);
-    if (ret < 0 )
-    {
-      printf("error: %s\n", libusb_error_name(ret));
-      return NULL;
+  bool ok = true;
+  if (correct) {
+    color_pipeline_t pipeline;
+    color_pipeline_init(&pipeline);
+    ok = color_pipeline_load(&pipeline, color_pipeline_path());
+    if (ok && !color_convert(&pipeline, rgb, rgb, length / 3)) {
+      printf("error: out of memory\n");
+      ok = false;
     }
   }
 
-  return hDev;
+  uint16_t passthrough = correct ? OPTION_PASSTHROUGH : 0;
+  ok = ok && perform_control_transfer(hDev, OPTION_REQUEST, passthrough, OPTION_PASSTHROUGH);
+  ok = ok && perform_frame_transfer(hDev, first, rgb, length / 3, true);
+  free(rgb);
+  return ok ? 0 : 1;
 }
 
+// queued_requests returns the number of requests in a batch that the
+// device queues instead of applying (those after an "at", see run_batch).
+static int queued_requests(const batch_t *batch)
+{
+  bool deferred = false;
+  int queued = 0;
+  for (int pos = 1; pos < batch->length; pos += 1 + batch_arg_length(batch->data[pos])) {
+    uint8_t request = batch->data[pos];
+    if (request == 20 || request == 24) {
+      deferred = true;
+    } else if (deferred && request != 19) {
+      queued++;
+    }
+  }
+  return queued;
+}
 
-bool perform_control_transfer(libusb_device_handle *hDev,
-  uint8_t request, uint16_t value, uint16_t index)
+/* Sends a batch of a sequence, once the device's queue has room for it.
+ * <room> is how many requests are known to fit; if that's not enough,
+ * the device is asked how many are queued, until enough have been played.
+ */
+static bool send_when_room(libusb_device_handle *hDev, batch_t *batch, int *room)
 {
-  int ret = libusb_control_transfer(
-      hDev,
-      LIBUSB_ENDPOINT_OUT
-        | LIBUSB_REQUEST_TYPE_VENDOR
-        | LIBUSB_RECIPIENT_DEVICE,
-      request,
-      value,
-      index,
-      NULL,  // data
-      0,  // data length
-      250);  // timeout in ms
-
-  if (ret < 0) {
-    printf("error: %s\n", libusb_error_name(ret));
-    return NULL;
+  int queued = queued_requests(batch);
+  while (queued > *room) {
+    struct timespec wait = { .tv_nsec = 10000000 };  // 10 ms
+    nanosleep(&wait, NULL);
+
+    mirror_t state = { 0 };
+    if (!mirror_read(hDev, &state)) {
+      if (state.unsupported) {
+        printf("error: sequence longer than the device's queue (%d requests)\n", QUEUE_LENGTH);
+      }
+      return false;
+    }
+    *room = QUEUE_LENGTH - state.queued;
   }
 
+  if (!perform_batch_transfer(hDev, batch)) return false;
+  *room -= queued;
   return true;
 }
 
-int main(int argc, char** argv)
+/* Queues a timed sequence of commands read from stdin, one
+ * "<ms> <command>" per line, to be played back by the device.
+ * Times are relative to <lead> ms from now.
+ *
+ * The device queues at most QUEUE_LENGTH requests. Longer sequences are
+ * uploaded as they play, so this returns when the last part is queued.
+ */
+int sequence(libusb_device_handle *hDev, uint16_t lead)
 {
-  if (argc == 2 && 0 == strcmp("off", argv[1])) {
-    libusb_device_handle *hDev = open_device();
-    if (hDev == NULL) return 1;
-    if (!perform_control_transfer(hDev, 0, 0, 0)) return 1;  // Turn off immediately
-    return 0;
+  batch_t batch;
+  batch_init(&batch);
+  batch_add(&batch, 19, lead, 0);  // New sequence
+  int room = QUEUE_LENGTH;  // cleared by the above
 
-  } else if (argc == 5 && 0 == strcmp("set", argv[1])) {
+  char line[256];
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    char *argv[MAX_SEQUENCE_ARGS + 2] = { "tool" };
+    int argc = 1;
+    for (char *tok = strtok(line, " \t\r\n"); tok != NULL; tok = strtok(NULL, " \t\r\n")) {
+      if (argc == MAX_SEQUENCE_ARGS + 1) {
+        printf("error: more than %d words in a line\n", MAX_SEQUENCE_ARGS);
+        return 1;
+      }
+      argv[argc++] = tok;
+    }
+    if (argc == 1) continue;  // empty line
 
-    int e = 0;
-    uint16_t r = str_to_uint16(argv[2]); e |= errno;
-    uint16_t g = str_to_uint16(argv[3]); e |= errno;
-    uint16_t b = str_to_uint16(argv[4]); e |= errno;
-    if (e != 0) {
-      printf("error: values must be numbers in range 0-65535\n");
+    errno = 0;
+    char *endptr;
+    unsigned long time = strtoul(argv[1], &endptr, 0);
+    if (errno != 0 || *endptr != '\0' || time > 0xffffffffUL) {
+      printf("error: times must be numbers of milliseconds\n");
       return 1;
     }
 
-    libusb_device_handle *hDev = open_device();
-    if (hDev == NULL) return 1;
-    if (!perform_control_transfer(hDev, 3, r, 0)) return 1;  // Set red
-    if (!perform_control_transfer(hDev, 4, g, 0)) return 1;  // Set green
-    if (!perform_control_transfer(hDev, 5, b, 0)) return 1;  // Set blue
-    if (!perform_control_transfer(hDev, 1, 0, 0)) return 1;  // Commit
-    return 0;
-
-  } else if ((argc == 5 || argc == 6) && 0 == strcmp("fade", argv[1])) {
-    int speed;
-    if (argc == 6) {
-      speed = str_to_uint16(argv[5]);
-      if (errno != 0) {
-        printf("error: values must be numbers in range 0-65535\n");
-        return 1;
-      }
-    } else {
-      speed = 256;
+    // "<ms> <command>": queue the command's requests at <ms>
+    argv[1] = argv[0];
+    batch_t command, timed;
+    if (!parse_command(argc - 1, argv + 1, &command)) return 1;
+    batch_init(&timed);
+    batch_add(&timed, 20, time & 0xffff, time >> 16);  // At
+    if (!batch_append(&timed, &command)) {
+      printf("error: command too long\n");
+      return 1;
     }
-
-    int e = 0;
-    uint16_t r = str_to_uint16(argv[2]); e |= errno;
-    uint16_t g = str_to_uint16(argv[3]); e |= errno;
-    uint16_t b = str_to_uint16(argv[4]); e |= errno;
-    if (e != 0) {
-      printf("error: values must be numbers in range 0-65535\n");
+    if (queued_requests(&timed) > QUEUE_LENGTH) {
+      printf("error: command has more requests than the device's queue (%d)\n", QUEUE_LENGTH);
       return 1;
     }
 
-    libusb_device_handle *hDev = open_device();
-    if (hDev == NULL) return 1;
-    if (!perform_control_transfer(hDev, 9, speed, 0)) return 1;  // Set fade speed
-    if (!perform_control_transfer(hDev, 6, r, 0)) return 1;  // Fade red to r
-    if (!perform_control_transfer(hDev, 7, g, 0)) return 1;  // Fade green to g
-    if (!perform_control_transfer(hDev, 8, b, 0)) return 1;  // Fade blue to b
-    return 0;
+    // Batches are only sent whole, so each must fit into the queue, too.
+    if (queued_requests(&batch) + queued_requests(&timed) > QUEUE_LENGTH
+        || !batch_append(&batch, &timed)) {
+      if (!send_when_room(hDev, &batch, &room)) return 1;
+      batch_init(&batch);
+      batch_append(&batch, &timed);
+    }
+  }
+
+  if (!send_when_room(hDev, &batch, &room)) return 1;
+  return 0;
+}
 
-  } else if (argc == 3 && 0 == strcmp("blink", argv[1]) && 0 == strcmp("off", argv[2])) {
+static double seconds_since(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-    libusb_device_handle *hDev = open_device();
-    if (hDev == NULL) return 1;
-    if (!perform_control_transfer(hDev, 10, 0, 0)) return 1;  // Disable blinking
-    return 0;
+/* Compares the transfer rate of synchronous and pipelined transfers.
+ * Sends empty batches, so the device state is not changed.
+ */
+int bench(libusb_device_handle *hDev, unsigned count)
+{
+  batch_t batch;
+  batch_init(&batch);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned i = 0; i < count; i++) {
+    if (!perform_batch_transfer(hDev, &batch)) return 1;
+  }
+  double sync_time = seconds_since(&start);
 
-  } else if ((argc == 3 || argc == 4) && 0 == strcmp("blink", argv[1])) {
-    long duty = 0, period = 0;
+  transfer_queue_t *queue = transfer_queue_new(BENCH_DEPTH, NULL);
+  if (queue == NULL) {
+    printf("error: out of memory\n");
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned i = 0; i < count; i++) {
+    transfer_queue_submit_batch(queue, hDev, &batch, NULL);
+  }
+  unsigned failed = transfer_queue_wait(queue);
+  double async_time = seconds_since(&start);
+  transfer_queue_free(queue);
+
+  printf("synchronous: %u transfers in %.3f s (%.1f/s)\n",
+      count, sync_time, count / sync_time);
+  printf("pipelined:   %u transfers in %.3f s (%.1f/s), %u failed, depth %u\n",
+      count, async_time, count / async_time, failed, BENCH_DEPTH);
+  return failed == 0 ? 0 : 1;
+}
+
+/* Prints the device's diagnostic counters, every <interval> ms if that
+ * isn't 0 (until interrupted). The longest main loop iteration is then
+ * the one since the previous line.
+ */
+int stats(libusb_device_handle *hDev, unsigned long interval)
+{
+  static const char *names[STATS_LENGTH / 2] = {
+    "setups", "crc_errors", "unknown", "rejected",
+    "missed_ticks", "led_sent", "led_interrupted", "max_loop_us",
+  };
 
-    duty = str_to_uint16(argv[2]);
-    if (errno != 0 || duty < 0 || duty > 65535) {
-      printf("error: values must be numbers in range 0-65535\n");
+  while (1) {
+    uint8_t data[STATS_LENGTH];
+    int length = perform_control_in_transfer(hDev, STATS_REQUEST, interval != 0, 0,
+        data, sizeof(data));
+    if (length < 0) return 1;
+    if (length != STATS_LENGTH) {
+      printf("error: unexpected reply (old firmware?)\n");
       return 1;
     }
 
-    if (argc == 4) {
-      period = str_to_uint16(argv[3]);
-      if (errno != 0 || period < 0 || period > 65535) {
-        printf("error: values must be numbers in range 0-65535\n");
+    for (int i = 0; i < STATS_LENGTH / 2; i++) {
+      unsigned value = data[2*i] | (data[2*i + 1] << 8);
+      if (i == STATS_LENGTH / 2 - 1) {
+        value = value * 776 / 100;  // 7.76us per count
+      }
+      printf(i == 0 ? "%s=%u" : " %s=%u", names[i], value);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    if (interval == 0) return 0;
+    struct timespec delay = { interval / 1000, (interval % 1000) * 1000000 };
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR);
+  }
+}
+
+/* Tells the daemon serving the device (if any) that we change the device
+ * behind its back, so that it reads the state again (see ledd.c).
+ */
+static void forget(const char *serial)
+{
+  char *argv[] = { "tool", "forget" };
+  daemon_request(serial, 2, argv);
+}
+
+static void broadcast_done(unsigned id, void *user, const char *error)
+{
+  if (error != NULL) {
+    printf("error: %s: %s\n", (const char *)user, error);
+  }
+}
+
+/* Sends a batch to every device (serials NULL) or to those in the
+ * comma-separated list serials.
+ *
+ * All devices are opened first, then the transfers to all of them are in
+ * flight at once, so this takes about as long as a single transfer.
+ */
+int broadcast(const char *serials, batch_t *batch)
+{
+  static libusb_device_handle *handles[MAX_GROUP];
+  static device_serial_t found[MAX_GROUP];
+
+  bool all_found;
+  int count = open_devices(serials, handles, found, MAX_GROUP, &all_found);
+  if (count == 0) {
+    if (serials == NULL) printf("error: device not found\n");
+    return 1;
+  }
+  forget(NULL);
+  for (int i = 0; i < count; i++) {
+    forget(found[i]);
+  }
+
+  transfer_queue_t *queue = transfer_queue_new(count, broadcast_done);
+  if (queue == NULL) {
+    printf("error: out of memory\n");
+    return 1;
+  }
+  for (int i = 0; i < count; i++) {
+    transfer_queue_submit_batch(queue, handles[i], batch, found[i]);
+  }
+  unsigned failed = transfer_queue_wait(queue);
+  transfer_queue_free(queue);
+
+  for (int i = 0; i < count; i++) {
+    libusb_close(handles[i]);
+  }
+  return failed == 0 && all_found ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+  // --device <serial> (before the command) selects a device,
+  // --device <serial>,<serial>,... or --all a group of them
+  const char *device = NULL;
+  bool group = false;
+  if (argc >= 3 && 0 == strcmp("--device", argv[1])) {
+    device = argv[2];
+    group = strchr(device, ',') != NULL;
+    argv[2] = argv[0];
+    argc -= 2;
+    argv += 2;
+  } else if (argc >= 2 && 0 == strcmp("--all", argv[1])) {
+    group = true;
+    argv[1] = argv[0];
+    argc -= 1;
+    argv += 1;
+  }
+
+  if (argc == 2 && 0 == strcmp("list", argv[1])) {
+    libusb_init(NULL);
+    return list_devices() > 0 ? 0 : 1;
+
+  } else if (group && argc >= 2 && (0 == strcmp("stream", argv[1])
+        || 0 == strcmp("frame", argv[1]) || 0 == strcmp("sequence", argv[1])
+        || 0 == strcmp("bench", argv[1]) || 0 == strcmp("stats", argv[1])
+        || 0 == strcmp("state", argv[1]))) {
+    printf("error: %s works with a single device only\n", argv[1]);
+    return 1;
+
+  } else if (argc >= 2 && 0 == strcmp("stream", argv[1])) {
+    bool binary = false;
+    unsigned fps = STREAM_DEFAULT_FPS;
+    for (int i = 2; i < argc; i++) {
+      if (0 == strcmp("--binary", argv[i])) {
+        binary = true;
+      } else if (0 == strcmp("--fps", argv[i]) && i + 1 < argc) {
+        fps = str_to_uint16(argv[++i]);
+        if (errno != 0) {
+          printf("error: values must be numbers in range 0-65535\n");
+          return 1;
+        }
+      } else {
+        print_usage();
         return 1;
-      } else if (duty > period) {
-        printf("error: duty time must be less than or equal to period\n");
+      }
+    }
+    libusb_init(NULL);
+    libusb_device_handle *hDev = open_device(device);
+    if (hDev == NULL) return 1;
+    forget(device);
+    return stream(hDev, binary, fps);
+
+  } else if (argc >= 2 && 0 == strcmp("frame", argv[1])) {
+    uint16_t first = 0;
+    bool hsv = false, correct = false, have_first = false;
+    for (int i = 2; i < argc; i++) {
+      if (0 == strcmp("--hsv", argv[i])) {
+        hsv = true;
+      } else if (0 == strcmp("--correct", argv[i])) {
+        correct = true;
+      } else if (!have_first) {
+        have_first = true;
+        first = str_to_uint16(argv[i]);
+        if (errno != 0) {
+          printf("error: values must be numbers in range 0-65535\n");
+          return 1;
+        }
+      } else {
+        print_usage();
         return 1;
       }
-    } else {
-      period = duty;
-      duty /= 2;
     }
+    libusb_init(NULL);
+    libusb_device_handle *hDev = open_device(device);
+    if (hDev == NULL) return 1;
+    forget(device);
+    return frame(hDev, first, hsv, correct);
 
-    libusb_device_handle *hDev = open_device();
+  } else if ((argc == 2 || argc == 3) && 0 == strcmp("sequence", argv[1])) {
+    uint16_t lead = 50;
+    if (argc == 3) {
+      lead = str_to_uint16(argv[2]);
+      if (errno != 0) {
+        printf("error: values must be numbers in range 0-65535\n");
+        return 1;
+      }
+    }
+    libusb_init(NULL);
+    libusb_device_handle *hDev = open_device(device);
     if (hDev == NULL) return 1;
-    if (!perform_control_transfer(hDev, 10, duty, period)) return 1;  // Set blink params
-    return 0;
+    forget(device);
+    return sequence(hDev, lead);
 
-  } else if (argc == 3 && 0 == strcmp("status", argv[1]) && 0 == strcmp("on", argv[2])) {
-    libusb_device_handle *hDev = open_device();
+  } else if ((argc == 2 || argc == 3) && 0 == strcmp("bench", argv[1])) {
+    unsigned count = 1000;
+    if (argc == 3) {
+      count = str_to_uint16(argv[2]);
+      if (errno != 0 || count == 0) {
+        printf("error: count must be a number in range 1-65535\n");
+        return 1;
+      }
+    }
+    libusb_init(NULL);
+    libusb_device_handle *hDev = open_device(device);
     if (hDev == NULL) return 1;
-    if (!perform_control_transfer(hDev, 2, 1, 0)) return 1;  // Set status
-    if (!perform_control_transfer(hDev, 1, 0, 0)) return 1;  // Commit
-    return 0;
+    forget(device);
+    return bench(hDev, count);
 
-  } else if (argc == 3 && 0 == strcmp("status", argv[1]) && 0 == strcmp("off", argv[2])) {
-    libusb_device_handle *hDev = open_device();
+  } else if ((argc == 2 || argc == 3) && 0 == strcmp("stats", argv[1])) {
+    unsigned long interval = 0;
+    if (argc == 3) {
+      interval = str_to_duration(argv[2]);
+      if (errno != 0) {
+        printf("error: interval must be a number of ms, s, m or h\n");
+        return 1;
+      }
+    }
+    libusb_init(NULL);
+    libusb_device_handle *hDev = open_device(device);
     if (hDev == NULL) return 1;
-    if (!perform_control_transfer(hDev, 2, 0, 0)) return 1;  // Set status
-    if (!perform_control_transfer(hDev, 1, 0, 0)) return 1;  // Commit
-    return 0;
+    return stats(hDev, interval);
 
-  } else if (argc == 3 && 0 == strcmp("status", argv[1]) && 0 == strcmp("blink", argv[2])) {
-    libusb_device_handle *hDev = open_device();
+  } else if (argc == 2 && 0 == strcmp("state", argv[1])) {
+    libusb_init(NULL);
+    libusb_device_handle *hDev = open_device(device);
     if (hDev == NULL) return 1;
-    if (!perform_control_transfer(hDev, 2, 2, 0)) return 1;  // Set status
-    if (!perform_control_transfer(hDev, 1, 0, 0)) return 1;  // Commit
+    mirror_t mirror = { .valid = false };
+    if (!mirror_read(hDev, &mirror)) {
+      if (mirror.unsupported) printf("error: unexpected reply (old firmware?)\n");
+      return 1;
+    }
+    mirror_print(&mirror);
     return 0;
+  }
 
-  } else {
-    printf("usage:\n");
-    printf("  set <r> <g> <b>\n");
-    printf("  fade <r> <g> <b> [<speed>]\n");
-    printf("  status (on|off|blink)\n");
-    printf("  blink <duty-ms> [<period-ms>]\n");
-    printf("  blink off\n");
-    printf("  off\n");
-    return 1;
+  batch_t batch;
+  if (!parse_command(argc, argv, &batch)) return 1;
+
+  if (group) {
+    libusb_init(NULL);
+    return broadcast(device, &batch);
   }
-}
 
+  // Prefer a running daemon: it already has the device open.
+  int status = daemon_request(device, argc, argv);
+  if (status >= 0) return status;
+
+  libusb_init(NULL);
+  libusb_device_handle *hDev = open_device(device);
+  if (hDev == NULL) return 1;
+  if (!perform_batch_transfer(hDev, &batch)) return 1;
+  return 0;
+}
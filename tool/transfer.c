@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transfer.h"
+
+
+/* Asynchronous control transfers.
+ *
+ * Keeps up to <depth> transfers in flight instead of waiting a full
+ * round trip for each one. Results are still reported in submission
+ * order: the oldest transfer is always reaped first.
+ */
+
+
+typedef struct {
+  struct libusb_transfer *transfer;
+  unsigned id;
+  void *user;
+  int completed;  // int, as needed by libusb_handle_events_completed
+  const char *error;
+} transfer_slot_t;
+
+struct transfer_queue {
+  transfer_slot_t *slots;
+  unsigned depth;
+  unsigned head, count;  // ring buffer of in-flight transfers
+  unsigned next_id;
+  unsigned failed;
+  transfer_done_fn done;
+  const char *broken;  // event handling failed: error name, else NULL
+};
+
+
+static void LIBUSB_CALL transfer_callback(struct libusb_transfer *transfer)
+{
+  transfer_slot_t *slot = transfer->user_data;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    slot->error = libusb_error_name(transfer->status);
+  }
+  slot->completed = 1;
+}
+
+static void default_done(unsigned id, void *user, const char *error)
+{
+  if (error != NULL) {
+    printf("error: transfer %u: %s\n", id, error);
+  }
+}
+
+transfer_queue_t* transfer_queue_new(unsigned depth, transfer_done_fn done)
+{
+  transfer_queue_t *queue = calloc(1, sizeof(transfer_queue_t));
+  if (queue == NULL) return NULL;
+
+  queue->slots = calloc(depth, sizeof(transfer_slot_t));
+  if (queue->slots == NULL) {
+    free(queue);
+    return NULL;
+  }
+
+  for (unsigned i = 0; i < depth; i++) {
+    queue->slots[i].transfer = libusb_alloc_transfer(0);
+    if (queue->slots[i].transfer == NULL) {
+      queue->depth = i;
+      transfer_queue_free(queue);
+      return NULL;
+    }
+    queue->slots[i].transfer->buffer = NULL;
+  }
+
+  queue->depth = depth;
+  queue->done = done != NULL ? done : default_done;
+  return queue;
+}
+
+void transfer_queue_free(transfer_queue_t *queue)
+{
+  transfer_queue_wait(queue);
+  if (queue->broken != NULL) {
+    // Transfers may still be in flight, and libusb may still write to
+    // them and their slots. Leave them be.
+    free(queue);
+    return;
+  }
+  for (unsigned i = 0; i < queue->depth; i++) {
+    free(queue->slots[i].transfer->buffer);
+    libusb_free_transfer(queue->slots[i].transfer);
+  }
+  free(queue->slots);
+  free(queue);
+}
+
+// Waits for the oldest transfer and reports its result.
+//
+// If event handling fails, the transfer is cancelled, and waited for
+// until the cancellation completes. If even that fails, the queue is
+// broken: the transfer may still be in flight, so neither it nor its
+// buffer may be reused, and no more transfers are submitted.
+static void reap_one(transfer_queue_t *queue)
+{
+  transfer_slot_t *slot = &queue->slots[queue->head];
+  const char *error = NULL;
+
+  while (!slot->completed && queue->broken == NULL) {
+    int ret = libusb_handle_events_completed(NULL, &slot->completed);
+    if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+      if (error == NULL) {
+        error = libusb_error_name(ret);
+        libusb_cancel_transfer(slot->transfer);
+      } else {
+        queue->broken = error;
+      }
+    }
+  }
+  if (!slot->completed) {
+    slot->error = queue->broken;
+  } else if (error != NULL) {
+    slot->error = error;
+  }
+
+  if (slot->error != NULL) {
+    queue->failed++;
+  }
+  queue->done(slot->id, slot->user, slot->error);
+
+  queue->head = (queue->head + 1) % queue->depth;
+  queue->count--;
+}
+
+/* Submits a vendor control-out transfer, first waiting for the oldest one
+ * if <depth> transfers are already in flight.
+ *
+ * Returns the transfer's id, which is passed to the done callback.
+ */
+unsigned transfer_queue_submit_control(transfer_queue_t *queue,
+  libusb_device_handle *hDev, uint8_t request, uint16_t value, uint16_t index,
+  const uint8_t *data, uint16_t length, void *user)
+{
+  if (queue->count == queue->depth) {
+    reap_one(queue);
+  }
+
+  transfer_slot_t *slot = &queue->slots[(queue->head + queue->count) % queue->depth];
+  struct libusb_transfer *transfer = slot->transfer;
+
+  slot->id = queue->next_id++;
+  slot->user = user;
+  slot->completed = 0;
+  slot->error = NULL;
+  queue->count++;
+
+  if (queue->broken != NULL) {
+    // The slot's transfer may still be in flight (see reap_one)
+    slot->error = queue->broken;
+    slot->completed = 1;
+    return slot->id;
+  }
+
+  unsigned char *buffer = realloc(transfer->buffer, LIBUSB_CONTROL_SETUP_SIZE + length);
+  if (buffer == NULL) {
+    slot->error = libusb_error_name(LIBUSB_ERROR_NO_MEM);
+    slot->completed = 1;
+    return slot->id;
+  }
+  transfer->buffer = buffer;
+
+  libusb_fill_control_setup(buffer,
+      LIBUSB_ENDPOINT_OUT
+        | LIBUSB_REQUEST_TYPE_VENDOR
+        | LIBUSB_RECIPIENT_DEVICE,
+      request, value, index, length);
+  if (length > 0) {
+    memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+  }
+  libusb_fill_control_transfer(transfer, hDev, buffer, transfer_callback, slot,
+      250);  // timeout in ms
+
+  int ret = libusb_submit_transfer(transfer);
+  if (ret < 0) {
+    slot->error = libusb_error_name(ret);
+    slot->completed = 1;
+  }
+
+  return slot->id;
+}
+
+unsigned transfer_queue_submit_batch(transfer_queue_t *queue,
+  libusb_device_handle *hDev, batch_t *batch, void *user)
+{
+  return transfer_queue_submit_control(queue, hDev, BATCH_REQUEST, 0, 0,
+      batch->data, batch->length, user);
+}
+
+/* Waits for all transfers in flight.
+ *
+ * Returns the number of transfers that failed since the last call.
+ */
+unsigned transfer_queue_wait(transfer_queue_t *queue)
+{
+  while (queue->count > 0) {
+    reap_one(queue);
+  }
+
+  unsigned failed = queue->failed;
+  queue->failed = 0;
+  return failed;
+}
@@ -0,0 +1,29 @@
+#ifndef _TRANSFER_H
+#define _TRANSFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libusb.h>
+
+#include "device.h"
+
+
+typedef struct transfer_queue transfer_queue_t;
+
+// Called for every transfer in the order they were submitted.
+// error is NULL if the transfer succeeded.
+typedef void (*transfer_done_fn)(unsigned id, void *user, const char *error);
+
+transfer_queue_t* transfer_queue_new(unsigned depth, transfer_done_fn done);
+void transfer_queue_free(transfer_queue_t *queue);
+
+unsigned transfer_queue_submit_control(transfer_queue_t *queue,
+  libusb_device_handle *hDev, uint8_t request, uint16_t value, uint16_t index,
+  const uint8_t *data, uint16_t length, void *user);
+unsigned transfer_queue_submit_batch(transfer_queue_t *queue,
+  libusb_device_handle *hDev, batch_t *batch, void *user);
+
+unsigned transfer_queue_wait(transfer_queue_t *queue);
+
+#endif